@@ -0,0 +1,417 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "vxl.h"
+#include "trace.h"
+#include "perf.h"
+#include "common.h"
+
+/*
+
+HEADLESS VXL BENCHMARK
+
+Runs named scenarios against vxl.c without SDL/GL and prints one
+tab-separated line per scenario (header first), so that two builds can be
+compared with diff/awk/whatever:
+
+  ./bench                 # run all scenarios
+  ./bench put_churn ...   # run only the named scenarios
+  ./bench -l              # list scenarios
+  ./bench -j 4 ...        # use 4 threads in vxl_flush() (default: one per CPU)
+  ./bench -t t.json ...   # also write a trace of the spans (see trace.h)
+  ./bench -p ...          # also print "# perf" lines with hardware counters
+                          # per vxl_flush() phase (see perf.h)
+
+Columns:
+  ns_per_voxel     total time divided by "voxels processed"; for flush-heavy
+                   scenarios that's world voxels per flush, for put-heavy
+                   scenarios it's the number of voxels written by vxl_put()
+                   calls or box edits
+  ns_per_diagonal  total time divided by the number of rendered diagonals
+  flushes          vxl_flush() calls (including full ones)
+  peak_*_queue     number of distinct voxels/diagonals pending at flush time
+  memory_mb        vxl_memory_usage() at the end of the scenario
+  faces_ms         time vxl_flush() spent updating faces (vxl_stats.faces_ns)
+  render_ms        time vxl_flush() spent on everything else
+  layout           chunk layout the bench was built with; see vxl.h
+
+"make bench_layouts" builds one bench per chunk layout and runs the
+scenarios in LAYOUT_SCENARIOS (Makefile.common) with each.
+
+*/
+
+#ifdef VXL_MORTON
+#define LAYOUT_ORDER "morton"
+#else
+#define LAYOUT_ORDER "linear"
+#endif
+
+static u32 rng_state;
+static int n_threads;
+// NULL unless -p
+static struct perf* perf;
+
+static u32 rng()
+{
+	// xorshift32
+	u32 x = rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return rng_state = x;
+}
+
+struct result {
+	s64 ns;
+	int iterations;
+	s64 n_voxels;
+};
+
+// same rolling hills + center tower as the debug drawing in main.c, scaled to
+// the world size. hills are as high as they'd be in a world of height hz
+static void terrain(struct vxl* vxl, int dx, int dy, int dz, int hz)
+{
+	vxl_set_full_update(vxl);
+	const float s = 128.0f / (float)dx;
+	for (int y = 0; y < dy; y++) {
+		for (int x = 0; x < dx; x++) {
+			float f = sinf((float)x * 0.05f * s) * sinf((float)y * 0.07f * s);
+			int h = (hz*5)/32 + (int)((f+1.0f) * (float)hz * (10.0f/32.0f));
+			h = MAX(h, 0);
+			h = MIN(h, dz);
+			const int mid = (dx*24)/128;
+			const int is_mid = x >= (dx-mid)/2 && x <= (dx+mid)/2 && y >= (dy-mid)/2 && y <= (dy+mid)/2;
+			if (is_mid) h = dz-1;
+			for (int z = 0; z < h; z++) {
+				vxl_put(vxl, x, y, z, 1);
+			}
+		}
+	}
+	vxl_flush(vxl);
+}
+
+static void setup_flags(struct vxl* vxl, int dx, int dy, int dz, int hz, int flags)
+{
+	vxl_init(vxl, dx, dy, dz, flags);
+	vxl_set_threads(vxl, n_threads);
+	terrain(vxl, dx, dy, dz, hz);
+	memset(&vxl->stats, 0, sizeof vxl->stats);
+	if (perf != NULL) perf_reset(perf);
+	vxl->perf = perf;
+	rng_state = 0x12345678;
+}
+
+static void setup_hz(struct vxl* vxl, int dx, int dy, int dz, int hz)
+{
+	setup_flags(vxl, dx, dy, dz, hz, 0);
+}
+
+static void setup(struct vxl* vxl, int dx, int dy, int dz)
+{
+	setup_hz(vxl, dx, dy, dz, dz);
+}
+
+static void run_full_flush(struct vxl* vxl, struct result* r, int dx, int dy, int dz, int hz, int iterations)
+{
+	setup_hz(vxl, dx, dy, dz, hz);
+	s64 t0 = trace_now_ns();
+	for (int i = 0; i < iterations; i++) {
+		vxl_set_full_update(vxl);
+		vxl_flush(vxl);
+	}
+	r->ns = trace_now_ns() - t0;
+	r->iterations = iterations;
+	r->n_voxels = (s64)iterations * vxl->dim_x * vxl->dim_y * vxl->dim_z;
+}
+
+static void run_put_churn(struct vxl* vxl, struct result* r, int dx, int dy, int dz, int frames, int puts_per_frame)
+{
+	setup(vxl, dx, dy, dz);
+	s64 t0 = trace_now_ns();
+	for (int i = 0; i < frames; i++) {
+		for (int j = 0; j < puts_per_frame; j++) {
+			int x = rng() % dx;
+			int y = rng() % dy;
+			int z = rng() % dz;
+			vxl_put(vxl, x, y, z, rng() & 1);
+		}
+		vxl_flush(vxl);
+	}
+	r->ns = trace_now_ns() - t0;
+	r->iterations = frames;
+	r->n_voxels = (s64)frames * puts_per_frame;
+}
+
+static void bench_full_flush(struct vxl* vxl, struct result* r)
+{
+	run_full_flush(vxl, r, 128, 128, 32, 32, 50);
+}
+
+static void bench_put_churn(struct vxl* vxl, struct result* r)
+{
+	run_put_churn(vxl, r, 128, 128, 32, 200, 1024);
+}
+
+static void bench_column_sweep(struct vxl* vxl, struct result* r)
+{
+	// the per-frame edit pattern of main.c
+	const int dx = 128;
+	const int dy = 128;
+	const int dz = 32;
+	const int frames = 256;
+	setup(vxl, dx, dy, dz);
+	s64 n_puts = 0;
+	s64 t0 = trace_now_ns();
+	for (int iteration = 0; iteration < frames; iteration++) {
+		for (int y = 0; y < dy; y++) {
+			for (int x = 0; x < dx; x++) {
+				{
+					const int mid = 24;
+					const int is_mid = x >= (dx-mid)/2 && x <= (dx+mid)/2 && y >= (dy-mid)/2 && y <= (dy+mid)/2;
+					if (is_mid) {
+						int h = (iteration >> 2) & (dz-1);
+						for (int z = 0; z < dz; z++) {
+							vxl_put(vxl, x, y, z, z < h ? 1 : 0);
+						}
+						n_puts += dz;
+					}
+				}
+				{
+					const int mid = 12;
+					const int is_mid = x >= (dx-mid)/2 && x <= (dx+mid)/2 && y >= (dy-mid)/2 && y <= (dy+mid)/2;
+					if (is_mid) {
+						int h = (iteration >> 3) & (dz-1);
+						for (int z = 0; z < dz; z++) {
+							vxl_put(vxl, x, y, z, z < h ? 1 : 0);
+						}
+						n_puts += dz;
+					}
+				}
+			}
+		}
+		vxl_flush(vxl);
+	}
+	r->ns = trace_now_ns() - t0;
+	r->iterations = frames;
+	r->n_voxels = n_puts;
+}
+
+// the same edits as bench_column_sweep(), a column at a time
+static void bench_column_sweep_columns(struct vxl* vxl, struct result* r)
+{
+	const int dx = 128;
+	const int dy = 128;
+	const int dz = 32;
+	const int frames = 256;
+	setup(vxl, dx, dy, dz);
+	static const int mids[] = {24, 12};
+	static const int shifts[] = {2, 3};
+	u8 columns[2][32];
+	s64 n_puts = 0;
+	s64 t0 = trace_now_ns();
+	for (int iteration = 0; iteration < frames; iteration++) {
+		for (int i = 0; i < 2; i++) {
+			int h = (iteration >> shifts[i]) & (dz-1);
+			for (int z = 0; z < dz; z++) columns[i][z] = z < h ? 1 : 0;
+		}
+		for (int y = 0; y < dy; y++) {
+			for (int x = 0; x < dx; x++) {
+				for (int i = 0; i < 2; i++) {
+					const int mid = mids[i];
+					const int is_mid = x >= (dx-mid)/2 && x <= (dx+mid)/2 && y >= (dy-mid)/2 && y <= (dy+mid)/2;
+					if (!is_mid) continue;
+					vxl_put_column(vxl, x, y, 0, dz, columns[i]);
+					n_puts += dz;
+				}
+			}
+		}
+		vxl_flush(vxl);
+	}
+	r->ns = trace_now_ns() - t0;
+	r->iterations = frames;
+	r->n_voxels = n_puts;
+}
+
+// the same edits as bench_column_sweep(), as boxes (like main.c does)
+static void bench_column_sweep_boxes(struct vxl* vxl, struct result* r)
+{
+	const int dx = 128;
+	const int dy = 128;
+	const int dz = 32;
+	const int frames = 256;
+	setup(vxl, dx, dy, dz);
+	s64 n_puts = 0;
+	s64 t0 = trace_now_ns();
+	for (int iteration = 0; iteration < frames; iteration++) {
+		static const int mids[] = {24, 12};
+		static const int shifts[] = {2, 3};
+		for (int i = 0; i < 2; i++) {
+			const int mid = mids[i];
+			const int x0 = (dx-mid)/2, x1 = (dx+mid)/2 + 1;
+			const int y0 = (dy-mid)/2, y1 = (dy+mid)/2 + 1;
+			int h = (iteration >> shifts[i]) & (dz-1);
+			vxl_fill_box(vxl, x0, y0, 0, x1, y1, h, 1);
+			vxl_fill_box(vxl, x0, y0, h, x1, y1, dz, 0);
+			n_puts += (s64)(x1-x0) * (y1-y0) * dz;
+		}
+		vxl_flush(vxl);
+	}
+	r->ns = trace_now_ns() - t0;
+	r->iterations = frames;
+	r->n_voxels = n_puts;
+}
+
+static void run_rotation_spam(struct vxl* vxl, struct result* r, int flags)
+{
+	const int iterations = 40;
+	setup_flags(vxl, 128, 128, 32, 32, flags);
+	s64 t0 = trace_now_ns();
+	for (int i = 0; i < iterations; i++) {
+		vxl_set_rotation(vxl, i+1);
+		vxl_flush(vxl);
+	}
+	r->ns = trace_now_ns() - t0;
+	r->iterations = iterations;
+	r->n_voxels = (s64)iterations * vxl->dim_x * vxl->dim_y * vxl->dim_z;
+}
+
+static void bench_rotation_spam(struct vxl* vxl, struct result* r)
+{
+	run_rotation_spam(vxl, r, 0);
+}
+
+static void bench_cached_rotation_spam(struct vxl* vxl, struct result* r)
+{
+	// only the first lap renders; after that rotating is a view swap
+	run_rotation_spam(vxl, r, VXL_CACHE_ROTATIONS);
+}
+
+static void bench_large_full_flush(struct vxl* vxl, struct result* r)
+{
+	run_full_flush(vxl, r, 512, 512, 64, 64, 5);
+}
+
+static void bench_tall_full_flush(struct vxl* vxl, struct result* r)
+{
+	// mostly air; hills as low as in a 32 high world
+	run_full_flush(vxl, r, 128, 128, 256, 32, 10);
+}
+
+static void bench_large_put_churn(struct vxl* vxl, struct result* r)
+{
+	run_put_churn(vxl, r, 512, 512, 64, 50, 4096);
+}
+
+struct scenario {
+	const char* name;
+	void(*fn)(struct vxl*, struct result*);
+};
+
+static struct scenario scenarios[] = {
+	{"full_flush",       bench_full_flush},
+	{"put_churn",        bench_put_churn},
+	{"column_sweep",     bench_column_sweep},
+	{"column_sweep_columns", bench_column_sweep_columns},
+	{"column_sweep_boxes", bench_column_sweep_boxes},
+	{"rotation_spam",    bench_rotation_spam},
+	{"cached_rotation_spam", bench_cached_rotation_spam},
+	{"large_full_flush", bench_large_full_flush},
+	{"large_put_churn",  bench_large_put_churn},
+	{"tall_full_flush",  bench_tall_full_flush},
+};
+
+static void run(struct scenario* sc)
+{
+	struct vxl vxl;
+	struct result r;
+	memset(&r, 0, sizeof r);
+	const s64 trace_t0 = trace_begin();
+	sc->fn(&vxl, &r);
+	trace_end(sc->name, trace_t0);
+
+	struct vxl_stats* st = &vxl.stats;
+	printf("%s\t%dx%dx%d\t%d\t%d\t%.3f\t%.3f\t%.3f\t%d\t%d\t%d\t%.1f\t%.3f\t%.3f\t%s%d\n",
+		sc->name,
+		vxl.dim_x, vxl.dim_y, vxl.dim_z,
+		vxl.n_threads,
+		r.iterations,
+		(double)r.ns * 1e-6,
+		r.n_voxels > 0 ? (double)r.ns / (double)r.n_voxels : 0.0,
+		st->n_rendered > 0 ? (double)r.ns / (double)st->n_rendered : 0.0,
+		st->n_flushes,
+		st->shade_dirty_peak,
+		st->render_dirty_peak,
+		(double)vxl_memory_usage(&vxl) / (1024.0 * 1024.0),
+		(double)st->faces_ns * 1e-6,
+		(double)st->render_ns * 1e-6,
+		LAYOUT_ORDER, CHUNK_LENGTH);
+	if (perf != NULL) perf_report(perf, stdout, sc->name);
+	fflush(stdout);
+
+	vxl_free(&vxl);
+}
+
+int main(int argc, char** argv)
+{
+	const int n_scenarios = ARRAY_LENGTH(scenarios);
+
+	if (argc == 2 && strcmp(argv[1], "-l") == 0) {
+		for (int i = 0; i < n_scenarios; i++) printf("%s\n", scenarios[i].name);
+		return EXIT_SUCCESS;
+	}
+
+	const char* trace_path = NULL;
+	struct perf perf_counters;
+	for (;;) {
+		if (argc >= 2 && strcmp(argv[1], "-p") == 0 && perf == NULL) {
+			perf_init(&perf_counters);
+			perf = &perf_counters;
+			argv[1] = argv[0];
+			argc--;
+			argv++;
+			continue;
+		}
+		if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+			n_threads = atoi(argv[2]);
+		} else if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+			trace_path = argv[2];
+			trace_enable(1);
+			trace_name_thread("bench");
+		} else {
+			break;
+		}
+		argv[2] = argv[0];
+		argc -= 2;
+		argv += 2;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		int found = 0;
+		for (int j = 0; j < n_scenarios; j++) if (strcmp(argv[i], scenarios[j].name) == 0) found = 1;
+		if (!found) {
+			fprintf(stderr, "no such scenario: %s (try -l)\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("scenario\tdim\tthreads\titerations\ttotal_ms\tns_per_voxel\tns_per_diagonal\tflushes\tpeak_shade_queue\tpeak_render_queue\tmemory_mb\tfaces_ms\trender_ms\tlayout\n");
+
+	for (int j = 0; j < n_scenarios; j++) {
+		int selected = argc == 1;
+		for (int i = 1; i < argc; i++) if (strcmp(argv[i], scenarios[j].name) == 0) selected = 1;
+		if (selected) run(&scenarios[j]);
+	}
+
+	if (perf != NULL) perf_free(perf);
+
+	if (trace_path != NULL && trace_dump(trace_path) < 0) {
+		fprintf(stderr, "could not write trace to %s\n", trace_path);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
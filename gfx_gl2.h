@@ -3,8 +3,14 @@
 #include <string.h>
 
 #define GL_GLEXT_PROTOTYPES
+// headless.c gets its context from EGL, not SDL
+#ifdef GFX_GL2_NO_SDL
+#include <GL/gl.h>
+#include <GL/glext.h>
+#else
 #include <SDL_opengl.h>
 #include <SDL_opengl_glext.h>
+#endif
 
 #include "common.h"
 
@@ -209,19 +215,86 @@ struct px_vertex {
 
 struct px_uniforms {
 	float u_src_resolution[2];
+	float u_src_valid[4];
 	float u_dst_resolution[2];
 	int u_src_texture;
 };
 
+// view rectangle
+struct px_rect {
+	int x, y;
+	int w, h;
+};
+
+// what px_present() shows: a view into an image that isn't copied first.
+// view pixel [x,y] is pixels[(x0+x) + (y0+y)*stride], or transparent if
+// that's outside the width×height image
+struct px_source {
+	const u32* pixels;
+	int stride;
+	int width;
+	int height;
+	int x0;
+	int y0;
+};
+
+/*
+
+PIXEL BUFFER UPLOAD
+
+glTexSubImage2D() from client memory makes the driver copy the pixels before
+it returns. When pixel buffer objects are available px_present() instead
+copies the rectangles into the next buffer of a ring of PX_N_PBOS mapped
+buffers and uploads from that, so the transfer can run while the CPU works
+on the next frame. With fence syncs (GL_ARB_sync) a buffer is reused once
+its previous upload is done; without them it's orphaned with
+glBufferData() instead. Set PX_NO_PBO in the environment to force the
+plain glTexSubImage2D() path (e.g. to compare both under Mesa's software
+rasterizer with LIBGL_ALWAYS_SOFTWARE=1).
+
+*/
+
+#define PX_N_PBOS (3)
+
 struct px {
 	struct prg prg;
 	struct px_vertex vertices[6];
 	GLuint vertices_buf;
 	struct px_uniforms uniforms;
 	GLuint texture;
+	int texture_width;
+	int texture_height;
 	int iteration;
+
+	int use_pbo;
+	int use_sync;
+	GLuint pbos[PX_N_PBOS];
+	GLsync fences[PX_N_PBOS];
+	int pbo_index;
+	size_t pbo_sizes[PX_N_PBOS];
 };
 
+static int gl_has_extension(const char* name)
+{
+	const char* exts = (const char*)glGetString(GL_EXTENSIONS);
+	if (exts == NULL) return 0;
+	size_t n = strlen(name);
+	for (const char* p = exts; (p = strstr(p, name)) != NULL; p += n) {
+		if ((p == exts || p[-1] == ' ') && (p[n] == ' ' || p[n] == 0)) return 1;
+	}
+	return 0;
+}
+
+// GL version as major*10+minor
+static int gl_version()
+{
+	const char* v = (const char*)glGetString(GL_VERSION);
+	int major = 0;
+	int minor = 0;
+	if (v == NULL || sscanf(v, "%d.%d", &major, &minor) != 2) return 0;
+	return major*10 + minor;
+}
+
 
 static struct vertex_attr px_vertex_attrs[] = {
 	ATTR_FLOATS(struct px_vertex, a_index),
@@ -234,6 +307,18 @@ static void px_init(struct px* px)
 
 	glGenTextures(1, &px->texture); CHKGL;
 
+	{
+		const int version = gl_version();
+		px->use_pbo = (version >= 21 || gl_has_extension("GL_ARB_pixel_buffer_object")) && getenv("PX_NO_PBO") == NULL;
+		px->use_sync = px->use_pbo && (version >= 32 || gl_has_extension("GL_ARB_sync"));
+		if (px->use_pbo) {
+			glGenBuffers(PX_N_PBOS, px->pbos); CHKGL;
+		}
+		#ifdef DEBUG
+		printf("px: pbo upload %s, fences %s\n", px->use_pbo ? "on" : "off", px->use_sync ? "on" : "off");
+		#endif
+	}
+
 	glGenBuffers(1, &px->vertices_buf); CHKGL;
 	glBindBuffer(GL_ARRAY_BUFFER, px->vertices_buf); CHKGL;
 	for (int i = 0; i < 4; i++) px->vertices[i].a_index = (float)i;
@@ -307,6 +392,7 @@ static void px_init(struct px* px)
 	//"precision highp float;\n"
 	//"\n"
 	"uniform vec2 u_src_resolution;\n"
+	"uniform vec4 u_src_valid;\n"
 	"\n"
 	"uniform sampler2D u_src_texture;\n"
 	"\n"
@@ -317,12 +403,18 @@ static void px_init(struct px* px)
 	"{\n"
 	"	vec2 uv = floor(v_uv) + 0.5;\n"
 	"	uv += 1.0 - clamp((1.0 - fract(v_uv)) * v_scale, 0.0, 1.0);\n"
-	"	gl_FragColor = texture2D(u_src_texture, uv / u_src_resolution);\n"
+	"	vec2 texel = floor(v_uv);\n"
+	"	if (any(lessThan(texel, u_src_valid.xy)) || any(greaterThanEqual(texel, u_src_valid.zw))) {\n"
+	"		gl_FragColor = vec4(0.0);\n"
+	"	} else {\n"
+	"		gl_FragColor = texture2D(u_src_texture, uv / u_src_resolution);\n"
+	"	}\n"
 	"}\n"
 	;
 
 	static struct uniform uniforms[] = {
 		UNIFORM_FLOATS(struct px_uniforms, u_src_resolution),
+		UNIFORM_FLOATS(struct px_uniforms, u_src_valid),
 		UNIFORM_FLOATS(struct px_uniforms, u_dst_resolution),
 		UNIFORM_INTS(struct px_uniforms, u_src_texture),
 		{0},
@@ -331,26 +423,128 @@ static void px_init(struct px* px)
 	prg_init(&px->prg, header, vert_src, frag_src, px_vertex_attrs, uniforms);
 }
 
-static void px_present(struct px* px, int dst_width, int dst_height, int src_width, int src_height, void* src_image)
+static void px_upload_direct(const struct px_source* src, struct px_rect* rects, int n_rects)
+{
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, src->stride); CHKGL;
+	for (int i = 0; i < n_rects; i++) {
+		struct px_rect* r = &rects[i];
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS, src->x0 + r->x); CHKGL;
+		glPixelStorei(GL_UNPACK_SKIP_ROWS, src->y0 + r->y); CHKGL;
+		glTexSubImage2D(GL_TEXTURE_2D, 0, r->x, r->y, r->w, r->h, GL_RGBA, GL_UNSIGNED_BYTE, src->pixels); CHKGL;
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0); CHKGL;
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0); CHKGL;
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0); CHKGL;
+}
+
+// the buffer has the layout of the texture, but only the rectangles are
+// written to it
+static void px_upload_pbo(struct px* px, const struct px_source* src, struct px_rect* rects, int n_rects)
+{
+	const int i = px->pbo_index;
+	px->pbo_index = (i+1) % PX_N_PBOS;
+
+	const int w = px->texture_width;
+	const size_t size = (size_t)w * px->texture_height * sizeof(u32);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, px->pbos[i]); CHKGL;
+	if (px->fences[i] != NULL) {
+		glClientWaitSync(px->fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000); CHKGL;
+		glDeleteSync(px->fences[i]); CHKGL;
+		px->fences[i] = NULL;
+	}
+	if (size != px->pbo_sizes[i] || !px->use_sync) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW); CHKGL;
+		px->pbo_sizes[i] = size;
+	}
+
+	u32* dst = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY); CHKGL;
+	if (dst == NULL) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); CHKGL;
+		px_upload_direct(src, rects, n_rects);
+		return;
+	}
+	for (int j = 0; j < n_rects; j++) {
+		struct px_rect* r = &rects[j];
+		for (int y = r->y; y < r->y + r->h; y++) {
+			memcpy(
+				&dst[(size_t)y*w + r->x],
+				&src->pixels[(size_t)(src->y0 + y)*src->stride + src->x0 + r->x],
+				r->w * sizeof(u32));
+		}
+	}
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER); CHKGL;
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, w); CHKGL;
+	for (int j = 0; j < n_rects; j++) {
+		struct px_rect* r = &rects[j];
+		const size_t offset = ((size_t)r->y*w + r->x) * sizeof(u32);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, r->x, r->y, r->w, r->h, GL_RGBA, GL_UNSIGNED_BYTE, (const GLvoid*)offset); CHKGL;
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0); CHKGL;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); CHKGL;
+
+	if (px->use_sync) {
+		px->fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0); CHKGL;
+	}
+}
+
+// draws a view_width×view_height view of src scaled to the viewport. only
+// the n_rects rectangles of the view are uploaded to the texture, unless
+// the view size changed, in which case everything is. parts of the view
+// outside the source image are transparent (masked in the shader, so they
+// are never uploaded)
+static void px_present(struct px* px, int dst_width, int dst_height, int view_width, int view_height, const struct px_source* src, struct px_rect* rects, int n_rects)
 {
 	glBindTexture(GL_TEXTURE_2D, px->texture); CHKGL;
-	const GLint internal_format = GL_RGBA;
-	const GLenum format = GL_RGBA;
 
-	if (px->iteration == 0) {
+	struct px_rect all = {0, 0, view_width, view_height};
+	if (view_width != px->texture_width || view_height != px->texture_height) {
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); CHKGL;
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR); CHKGL;
-		glTexImage2D(GL_TEXTURE_2D, 0, internal_format, src_width, src_height, 0, format, GL_UNSIGNED_BYTE, src_image); CHKGL;
-	} else {
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, src_width, src_height, format, GL_UNSIGNED_BYTE, src_image); CHKGL;
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, view_width, view_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL); CHKGL;
+		px->texture_width = view_width;
+		px->texture_height = view_height;
+		rects = &all;
+		n_rects = 1;
+	}
+
+	// the part of the view that's inside the source image
+	const int valid_x0 = MAX(0, -src->x0);
+	const int valid_y0 = MAX(0, -src->y0);
+	const int valid_x1 = MIN(view_width, src->width - src->x0);
+	const int valid_y1 = MIN(view_height, src->height - src->y0);
+
+	struct px_rect clipped[n_rects > 0 ? n_rects : 1];
+	int n_clipped = 0;
+	for (int i = 0; i < n_rects; i++) {
+		struct px_rect* r = &rects[i];
+		int x0 = MAX(r->x, valid_x0);
+		int y0 = MAX(r->y, valid_y0);
+		int x1 = MIN(r->x + r->w, valid_x1);
+		int y1 = MIN(r->y + r->h, valid_y1);
+		if (x0 >= x1 || y0 >= y1) continue;
+		struct px_rect c = {x0, y0, x1-x0, y1-y0};
+		clipped[n_clipped++] = c;
+	}
+
+	if (n_clipped > 0) {
+		if (px->use_pbo) {
+			px_upload_pbo(px, src, clipped, n_clipped);
+		} else {
+			px_upload_direct(src, clipped, n_clipped);
+		}
 	}
 
 	prg_use(&px->prg);
 
 	struct px_uniforms* u = &px->uniforms;
 	u->u_src_texture = 0;
-	u->u_src_resolution[0] = src_width;
-	u->u_src_resolution[1] = src_height;
+	u->u_src_resolution[0] = view_width;
+	u->u_src_resolution[1] = view_height;
+	u->u_src_valid[0] = valid_x0;
+	u->u_src_valid[1] = valid_y0;
+	u->u_src_valid[2] = valid_x1;
+	u->u_src_valid[3] = valid_y1;
 	u->u_dst_resolution[0] = dst_width;
 	u->u_dst_resolution[1] = dst_height;
 
@@ -0,0 +1,486 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HEADLESS_GL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include "gfx_gl2.h"
+#endif
+
+#include "vxl.h"
+#include "scene.h"
+#include "timing.h"
+#include "trace.h"
+#include "common.h"
+
+/*
+
+HEADLESS RENDERING
+
+Runs main.c's scene (see scene.h) frame by frame without a window, and
+presents each frame either in software or through px_present() into an
+offscreen GL framebuffer. It can write chosen frames as PPM images or
+compare them with stored "golden" ones, so one run catches both rendering
+and performance regressions:
+
+  ./headless -o golden         # write frames 63, 127, 191 and 255 to golden/
+  ./headless -c golden         # compare them instead; fails on a mismatch
+  ./headless_gl -g -c golden   # the same through GL (works on Mesa llvmpipe)
+  ./headless -v                # also a tab-separated line per frame
+  ./headless -b frame=16       # fails if the p99 frame time is over 16 ms
+
+Options:
+  -n frames   frames to run (default 256)
+  -k n        capture every n'th frame (default 64)
+  -r n        rotate the view every n frames (default never, like main)
+  -g          present through GL in an EGL context without a surface
+              (headless_gl only) instead of in software
+  -o dir      write captured frames to dir/frame<NNNN>.ppm
+  -c dir      compare captured frames with dir/frame<NNNN>.ppm
+  -e n        allowed difference per colour channel when comparing (default 0)
+  -j n        threads in vxl_flush() (default: one per CPU)
+  -t path     write a trace of the spans (see trace.h)
+  -v          print the timings of each frame
+  -b s=n      fail if the p99 of series s (a name from the summary, without
+              "_ms") is over n, in ms for durations; can be repeated
+
+golden/ holds the images for the default options, and "make check" compares
+both presenters with them. Only rewrite them with -o after looking at what
+changed.
+
+A frame image is the whole vxl bitmap at one image pixel per bitmap pixel,
+over black. Both presenters copy/upload only the damaged part of the bitmap
+each frame, like main.c, so a damage rectangle that misses a change shows
+up in the images too. At 1:1 the GL path shows exactly the bitmap, so both
+paths share golden images.
+
+The summary at the end is min/avg/p99 per timing series (see timing.h)
+over the last TIMING_FRAMES frames. "present" is the software copy or the
+texture upload and draw, and "swap" is waiting for GL to finish drawing
+(glFinish()). Captures aren't part of any frame. Budgets (-b) are checked
+against these p99s, so a slow run fails like a wrong image does.
+
+*/
+
+// shows the whole bitmap in software: copies the damaged rectangles (or
+// all, for the first frame) to frame
+static void present_software(u32* frame, struct vxl* vxl, int all)
+{
+	const int w = vxl->bitmap_width;
+	const int h = vxl->bitmap_height;
+	struct vxl_rect everything = {0, 0, w, h};
+	const struct vxl_rect* rects = all ? &everything : vxl->damage;
+	const int n_rects = all ? 1 : vxl->n_damage;
+	for (int i = 0; i < n_rects; i++) {
+		const int x0 = MAX(rects[i].x0, 0);
+		const int y0 = MAX(rects[i].y0, 0);
+		const int x1 = MIN(rects[i].x1, w);
+		const int y1 = MIN(rects[i].y1, h);
+		for (int y = y0; y < y1 && x0 < x1; y++) {
+			memcpy(&frame[y*w + x0], &vxl->bitmap[y*w + x0], (x1-x0) * sizeof *frame);
+		}
+	}
+	vxl_clear_damage(vxl);
+}
+
+// rgba over black to rgb
+static void frame_to_rgb(const u32* frame, int n_pixels, u8* rgb)
+{
+	for (int i = 0; i < n_pixels; i++) {
+		const u32 a = frame[i] >> 24;
+		for (int c = 0; c < 3; c++) {
+			rgb[i*3+c] = (((frame[i] >> (c*8)) & 0xff) * a + 127) / 255;
+		}
+	}
+}
+
+#ifdef HEADLESS_GL
+struct gl {
+	EGLDisplay display;
+	EGLContext context;
+	GLuint framebuffer;
+	GLuint renderbuffer;
+	int width;
+	int height;
+	struct gfx gfx;
+	u32* readback;
+};
+
+// returns -1 if there's no GL to be had
+static int gl_init(struct gl* gl, int width, int height)
+{
+	memset(gl, 0, sizeof *gl);
+
+	// prefer Mesa's surfaceless platform, which needs no display server
+	gl->display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (get_platform_display != NULL) gl->display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (gl->display == EGL_NO_DISPLAY) gl->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	EGLint major, minor;
+	if (gl->display == EGL_NO_DISPLAY || !eglInitialize(gl->display, &major, &minor)) {
+		fprintf(stderr, "eglInitialize failed\n");
+		return -1;
+	}
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		fprintf(stderr, "eglBindAPI(EGL_OPENGL_API) failed\n");
+		return -1;
+	}
+
+	const EGLint config_attrs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config = NULL;
+	EGLint n_configs = 0;
+	eglChooseConfig(gl->display, config_attrs, &config, 1, &n_configs);
+	gl->context = eglCreateContext(gl->display, n_configs > 0 ? config : NULL, EGL_NO_CONTEXT, NULL);
+	if (gl->context == EGL_NO_CONTEXT || !eglMakeCurrent(gl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, gl->context)) {
+		fprintf(stderr, "no EGL context without a surface\n");
+		return -1;
+	}
+
+	#ifdef DEBUG
+	printf("GL_VERSION: %s, GL_RENDERER: %s\n", glGetString(GL_VERSION), glGetString(GL_RENDERER));
+	#endif
+
+	glGenFramebuffers(1, &gl->framebuffer); CHKGL;
+	glBindFramebuffer(GL_FRAMEBUFFER, gl->framebuffer); CHKGL;
+	glGenRenderbuffers(1, &gl->renderbuffer); CHKGL;
+	glBindRenderbuffer(GL_RENDERBUFFER, gl->renderbuffer); CHKGL;
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height); CHKGL;
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, gl->renderbuffer); CHKGL;
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "offscreen framebuffer incomplete\n");
+		return -1;
+	}
+	gl->width = width;
+	gl->height = height;
+
+	gfx_init(&gl->gfx);
+	assert((gl->readback = malloc(width * height * sizeof *gl->readback)) != NULL);
+	return 0;
+}
+
+// like present_view() in main.c, with the view being the whole bitmap
+static void present_gl(struct gl* gl, struct vxl* vxl, int all)
+{
+	struct px_rect rects[VXL_MAX_DAMAGE];
+	int n_rects = 0;
+	if (all) {
+		struct px_rect r = {0, 0, gl->width, gl->height};
+		rects[n_rects++] = r;
+	} else {
+		for (int i = 0; i < vxl->n_damage; i++) {
+			struct vxl_rect* d = &vxl->damage[i];
+			struct px_rect r = {d->x0, d->y0, d->x1 - d->x0, d->y1 - d->y0};
+			rects[n_rects++] = r;
+		}
+	}
+	vxl_clear_damage(vxl);
+
+	glViewport(0, 0, gl->width, gl->height); CHKGL;
+	glClearColor(0, 0, 0, 1); CHKGL;
+	glClear(GL_COLOR_BUFFER_BIT); CHKGL;
+	glEnable(GL_BLEND); CHKGL;
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); CHKGL;
+
+	struct px_source src;
+	src.pixels = vxl->bitmap;
+	src.stride = vxl->bitmap_width;
+	src.width = vxl->bitmap_width;
+	src.height = vxl->bitmap_height;
+	src.x0 = 0;
+	src.y0 = 0;
+	px_present(&gl->gfx.px, gl->width, gl->height, gl->width, gl->height, &src, rects, n_rects);
+}
+
+// the framebuffer as rgb, top row first
+static void gl_to_rgb(struct gl* gl, u8* rgb)
+{
+	const int w = gl->width;
+	const int h = gl->height;
+	glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, gl->readback); CHKGL;
+	for (int y = 0; y < h; y++) {
+		const u32* row = &gl->readback[(h-1-y) * w];
+		for (int x = 0; x < w; x++) {
+			for (int c = 0; c < 3; c++) rgb[(y*w + x)*3 + c] = row[x] >> (c*8);
+		}
+	}
+}
+#endif
+
+static int write_ppm(const char* path, const u8* rgb, int width, int height)
+{
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) return -1;
+	fprintf(f, "P6\n%d %d\n255\n", width, height);
+	fwrite(rgb, 3, width * height, f);
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+// binary PPMs with maxval 255 and no comments, like write_ppm() writes
+static u8* read_ppm(const char* path, int* width, int* height)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) return NULL;
+	int maxval;
+	u8* rgb = NULL;
+	if (fscanf(f, "P6 %d %d %d", width, height, &maxval) == 3 && maxval == 255 && fgetc(f) != EOF && *width > 0 && *height > 0) {
+		const size_t n = (size_t)*width * *height * 3;
+		assert((rgb = malloc(n)) != NULL);
+		if (fread(rgb, 1, n, f) != n) {
+			free(rgb);
+			rgb = NULL;
+		}
+	}
+	fclose(f);
+	return rgb;
+}
+
+// returns 0 if the frame matches the golden image at path
+static int compare_golden(const char* path, int frame, const u8* rgb, int width, int height, int tolerance)
+{
+	int golden_width, golden_height;
+	u8* golden = read_ppm(path, &golden_width, &golden_height);
+	if (golden == NULL) {
+		printf("# frame %d: can't read %s\n", frame, path);
+		return -1;
+	}
+	if (golden_width != width || golden_height != height) {
+		printf("# frame %d: %d×%d, but %s is %d×%d\n", frame, width, height, path, golden_width, golden_height);
+		free(golden);
+		return -1;
+	}
+
+	int n_differ = 0;
+	int max_diff = 0;
+	int first = -1;
+	for (int i = 0; i < width * height; i++) {
+		int diff = 0;
+		for (int c = 0; c < 3; c++) diff = MAX(diff, abs(rgb[i*3+c] - golden[i*3+c]));
+		max_diff = MAX(max_diff, diff);
+		if (diff <= tolerance) continue;
+		if (first < 0) first = i;
+		n_differ++;
+	}
+	free(golden);
+
+	if (n_differ == 0) {
+		printf("# frame %d: matches %s\n", frame, path);
+		return 0;
+	}
+	printf("# frame %d: %d pixels differ from %s by up to %d, the first at [%d,%d]\n",
+		frame, n_differ, path, max_diff, first % width, first / width);
+	return -1;
+}
+
+// parses "name=n" into budgets[series]; returns -1 if it isn't one
+static int parse_budget(const char* s, double* budgets)
+{
+	const char* eq = strchr(s, '=');
+	if (eq == NULL) return -1;
+	for (int i = 0; i < TIMING_N_SERIES; i++) {
+		const char* name = timing_series_names[i];
+		if (strlen(name) != (size_t)(eq - s) || strncmp(s, name, eq - s) != 0) continue;
+		budgets[i] = atof(eq + 1);
+		return 0;
+	}
+	return -1;
+}
+
+static void print_frame(struct timing* t)
+{
+	const s64* s = t->frames[(t->n_frames-1) % TIMING_FRAMES];
+	printf("%d", t->n_frames-1);
+	for (int i = 0; i < TIMING_N_SERIES; i++) {
+		if (i < TIMING_N_PHASES) {
+			printf("\t%.3f", (double)s[i] * 1e-6);
+		} else {
+			printf("\t%lld", (long long)s[i]);
+		}
+	}
+	printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+	int n_frames = 256;
+	int capture_every = 64;
+	int rotate_every = 0;
+	int use_gl = 0;
+	const char* out_dir = NULL;
+	const char* golden_dir = NULL;
+	int tolerance = 0;
+	int n_threads = 0;
+	const char* trace_path = NULL;
+	int verbose = 0;
+	double budgets[TIMING_N_SERIES];
+	for (int i = 0; i < TIMING_N_SERIES; i++) budgets[i] = -1;
+	for (int i = 1; i < argc; i++) {
+		const char* a = argv[i];
+		const int has_value = i+1 < argc;
+		if (strcmp(a, "-g") == 0) {
+			use_gl = 1;
+		} else if (strcmp(a, "-v") == 0) {
+			verbose = 1;
+		} else if (has_value && strcmp(a, "-n") == 0) {
+			n_frames = atoi(argv[++i]);
+		} else if (has_value && strcmp(a, "-k") == 0) {
+			capture_every = atoi(argv[++i]);
+		} else if (has_value && strcmp(a, "-r") == 0) {
+			rotate_every = atoi(argv[++i]);
+		} else if (has_value && strcmp(a, "-o") == 0) {
+			out_dir = argv[++i];
+		} else if (has_value && strcmp(a, "-c") == 0) {
+			golden_dir = argv[++i];
+		} else if (has_value && strcmp(a, "-e") == 0) {
+			tolerance = atoi(argv[++i]);
+		} else if (has_value && strcmp(a, "-j") == 0) {
+			n_threads = atoi(argv[++i]);
+		} else if (has_value && strcmp(a, "-b") == 0 && parse_budget(argv[i+1], budgets) == 0) {
+			i++;
+		} else if (has_value && strcmp(a, "-t") == 0) {
+			trace_path = argv[++i];
+			trace_enable(1);
+			trace_name_thread("headless");
+		} else {
+			fprintf(stderr, "usage: %s [-g] [-v] [-n frames] [-k capture every] [-r rotate every] [-o dir] [-c golden dir] [-e tolerance] [-b series=budget] [-j threads] [-t trace.json]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	#ifndef HEADLESS_GL
+	if (use_gl) {
+		fprintf(stderr, "-g: built without GL; use headless_gl\n");
+		return EXIT_FAILURE;
+	}
+	#endif
+
+	struct vxl vxl;
+	vxl_init(&vxl, SCENE_DIM_X, SCENE_DIM_Y, SCENE_DIM_Z, VXL_CACHE_ROTATIONS);
+	vxl_set_threads(&vxl, n_threads);
+	vxl_set_full_update(&vxl);
+	vxl_set_rotation(&vxl, 0);
+	scene_draw(&vxl);
+
+	const int width = vxl.bitmap_width;
+	const int height = vxl.bitmap_height;
+	u32* frame = NULL;
+	u8* rgb;
+	assert((rgb = malloc(width * height * 3)) != NULL);
+	#ifdef HEADLESS_GL
+	struct gl gl;
+	if (use_gl && gl_init(&gl, width, height) < 0) return EXIT_FAILURE;
+	#endif
+	if (!use_gl) assert((frame = calloc(width * height, sizeof *frame)) != NULL);
+
+	if (verbose) {
+		printf("frame");
+		for (int i = 0; i < TIMING_N_SERIES; i++) printf("\t%s%s", timing_series_names[i], i < TIMING_N_PHASES ? "_ms" : "");
+		printf("\n");
+	}
+
+	int n_failed = 0;
+	struct timing timing;
+	timing_init(&timing);
+	timing_frame(&timing);
+	for (int iteration = 0; iteration < n_frames; iteration++) {
+		const s64 trace_frame = trace_begin();
+		const struct vxl_stats stats0 = vxl.stats;
+
+		if (rotate_every > 0 && iteration > 0 && iteration % rotate_every == 0) {
+			vxl_set_rotation(&vxl, vxl.rotation + 1);
+		}
+		scene_frame(&vxl, iteration);
+		vxl_flush(&vxl);
+		timing_add_vxl(&timing, &stats0, &vxl.stats);
+
+		timing_begin(&timing);
+		s64 trace_t0 = trace_begin();
+		#ifdef HEADLESS_GL
+		if (use_gl) {
+			present_gl(&gl, &vxl, iteration == 0);
+		} else
+		#endif
+		{
+			present_software(frame, &vxl, iteration == 0);
+		}
+		trace_end("present", trace_t0);
+		timing_end(&timing, TIMING_PRESENT);
+
+		#ifdef HEADLESS_GL
+		if (use_gl) {
+			timing_begin(&timing);
+			trace_t0 = trace_begin();
+			glFinish();
+			trace_end("swap", trace_t0);
+			timing_end(&timing, TIMING_SWAP);
+		}
+		#endif
+
+		trace_end("frame", trace_frame);
+		timing_frame(&timing);
+		if (verbose) print_frame(&timing);
+
+		if (capture_every <= 0 || (iteration+1) % capture_every != 0) continue;
+		if (out_dir == NULL && golden_dir == NULL) continue;
+		#ifdef HEADLESS_GL
+		if (use_gl) {
+			gl_to_rgb(&gl, rgb);
+		} else
+		#endif
+		{
+			frame_to_rgb(frame, width * height, rgb);
+		}
+		char path[4096];
+		if (out_dir != NULL) {
+			snprintf(path, sizeof path, "%s/frame%.4d.ppm", out_dir, iteration);
+			if (write_ppm(path, rgb, width, height) < 0) {
+				fprintf(stderr, "could not write %s\n", path);
+				n_failed++;
+			}
+		}
+		if (golden_dir != NULL) {
+			snprintf(path, sizeof path, "%s/frame%.4d.ppm", golden_dir, iteration);
+			if (compare_golden(path, iteration, rgb, width, height, tolerance) < 0) n_failed++;
+		}
+		// captures aren't part of any frame
+		timing.frame_t0 = trace_now_ns();
+	}
+
+	printf("series\tmin\tavg\tp99\n");
+	for (int i = 0; i < TIMING_N_SERIES; i++) {
+		const struct timing_summary s = timing_summarize(&timing, i);
+		if (i < TIMING_N_PHASES) {
+			printf("%s_ms\t%.3f\t%.3f\t%.3f\n", timing_series_names[i], (double)s.min * 1e-6, (double)s.avg * 1e-6, (double)s.p99 * 1e-6);
+		} else {
+			printf("%s\t%lld\t%lld\t%lld\n", timing_series_names[i], (long long)s.min, (long long)s.avg, (long long)s.p99);
+		}
+	}
+	for (int i = 0; i < TIMING_N_SERIES; i++) {
+		if (budgets[i] < 0) continue;
+		const s64 ns_or_count = timing_summarize(&timing, i).p99;
+		const double p99 = i < TIMING_N_PHASES ? (double)ns_or_count * 1e-6 : (double)ns_or_count;
+		if (p99 <= budgets[i]) {
+			printf("# %s: p99 %g is within the budget of %g\n", timing_series_names[i], p99, budgets[i]);
+		} else {
+			printf("# %s: p99 %g is over the budget of %g\n", timing_series_names[i], p99, budgets[i]);
+			n_failed++;
+		}
+	}
+
+	vxl_free(&vxl);
+	free(frame);
+	free(rgb);
+
+	if (trace_path != NULL && trace_dump(trace_path) < 0) {
+		fprintf(stderr, "could not write trace to %s\n", trace_path);
+		return EXIT_FAILURE;
+	}
+
+	return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
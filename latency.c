@@ -0,0 +1,76 @@
+#include <string.h>
+
+#include "latency.h"
+#include "trace.h"
+#include "vxl.h"
+#include "common.h"
+
+static const char* stage_names[LATENCY_N_STAGES] = {
+	"flushed", "swapped", "finished",
+};
+
+void latency_init(struct latency* l)
+{
+	memset(l, 0, sizeof *l);
+}
+
+void latency_input(struct latency* l, s64 t)
+{
+	if (l->n_pending == LATENCY_MAX_PENDING) return;
+	l->pending[l->n_pending++] = t;
+}
+
+void latency_stage(struct latency* l, int stage)
+{
+	if (l->n_pending == 0) return;
+	const s64 now = trace_now_ns();
+	struct latency_histogram* h = &l->stages[stage];
+	for (int i = 0; i < l->n_pending; i++) {
+		const s64 age = MAX(now - l->pending[i], 0);
+		h->buckets[MIN(age / LATENCY_BUCKET_NS, LATENCY_BUCKETS-1)]++;
+		h->n++;
+		h->sum += age;
+		h->max = MAX(h->max, age);
+	}
+}
+
+void latency_work(struct latency* l, const struct vxl_stats* s0, const struct vxl_stats* s1)
+{
+	if (l->n_pending == 0) return;
+	l->n_put += s1->n_put - s0->n_put;
+	l->n_rendered += s1->n_rendered - s0->n_rendered;
+	l->n_forced_flushes += s1->n_forced_flushes - s0->n_forced_flushes;
+}
+
+void latency_frame(struct latency* l)
+{
+	if (l->n_pending == 0) return;
+	l->n_frames++;
+	l->n_pending = 0;
+}
+
+void latency_print(struct latency* l, FILE* f)
+{
+	fprintf(f, "input latency over %lld frames with input: %lld puts, %lld diagonals rendered, %lld forced flushes\n",
+		(long long)l->n_frames, (long long)l->n_put, (long long)l->n_rendered, (long long)l->n_forced_flushes);
+	for (int i = 0; i < LATENCY_N_STAGES; i++) {
+		const struct latency_histogram* h = &l->stages[i];
+		if (h->n == 0) continue;
+		fprintf(f, "  %s: %lld inputs, avg %.2f ms, max %.2f ms\n",
+			stage_names[i], (long long)h->n, (double)h->sum / h->n * 1e-6, (double)h->max * 1e-6);
+		s64 peak = 0;
+		int last = 0;
+		for (int j = 0; j < LATENCY_BUCKETS; j++) {
+			peak = MAX(peak, h->buckets[j]);
+			if (h->buckets[j] > 0) last = j;
+		}
+		for (int j = 0; j <= last; j++) {
+			char bar[41];
+			const int n = (int)((h->buckets[j] * 40 + peak - 1) / peak);
+			memset(bar, '#', n);
+			bar[n] = 0;
+			fprintf(f, "    %3d%s ms %6lld%s%s\n",
+				j * (LATENCY_BUCKET_NS / 1000000), j == LATENCY_BUCKETS-1 ? "+" : " ", (long long)h->buckets[j], n > 0 ? " " : "", bar);
+		}
+	}
+}
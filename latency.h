@@ -0,0 +1,82 @@
+#ifndef LATENCY_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+/*
+
+INPUT LATENCY
+
+struct latency measures how old an input is by the time the frame showing
+its effect is done: latency_input() notes an input event's time, and the
+main loop then calls latency_stage() as the frame the input went into gets
+flushed, swapped and (optionally) finished by the GPU. Each input adds its
+age at each stage to that stage's histogram of LATENCY_BUCKETS buckets of
+LATENCY_BUCKET_NS, the last one counting everything slower. The vxl work
+that frames with inputs pass to latency_work() is summed up too, so that
+inputs that wait long can be told apart from inputs that cost a lot; the
+caller picks what counts, like handling the inputs and the flush that
+renders them but not edits that happen every frame anyway.
+
+*/
+
+#define LATENCY_FLUSHED  (0) // vxl_flush() of the frame returned
+#define LATENCY_SWAPPED  (1) // the buffer swap returned
+#define LATENCY_FINISHED (2) // glFinish() after the swap returned
+#define LATENCY_N_STAGES (3)
+
+#define LATENCY_BUCKETS   (50)
+#define LATENCY_BUCKET_NS (1000000)
+
+// inputs waiting for their frame; more in one frame are dropped
+#define LATENCY_MAX_PENDING (64)
+
+struct vxl_stats;
+
+struct latency_histogram {
+	s64 buckets[LATENCY_BUCKETS];
+	s64 n;
+	s64 sum;
+	s64 max;
+};
+
+struct latency {
+	s64 pending[LATENCY_MAX_PENDING];
+	int n_pending;
+
+	struct latency_histogram stages[LATENCY_N_STAGES];
+
+	// frames with inputs, and the vxl work they did
+	s64 n_frames;
+	s64 n_put;
+	s64 n_rendered;
+	s64 n_forced_flushes;
+};
+
+void latency_init(struct latency* l);
+
+// an input that happened at t (in trace_now_ns() time)
+void latency_input(struct latency* l, s64 t);
+
+// the frame's pending inputs have reached stage
+void latency_stage(struct latency* l, int stage);
+
+// adds the work a vxl did between its stats s0 and s1, if the frame has
+// inputs; can be called more than once a frame
+void latency_work(struct latency* l, const struct vxl_stats* s0, const struct vxl_stats* s1);
+
+// ends the frame; its inputs are done
+void latency_frame(struct latency* l);
+
+// true if the frame being made has inputs
+static inline int latency_pending(struct latency* l)
+{
+	return l->n_pending > 0;
+}
+
+// a line per stage with samples, then its histogram
+void latency_print(struct latency* l, FILE* f);
+
+#define LATENCY_H
+#endif
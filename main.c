@@ -2,6 +2,10 @@
 #include "gfx_gl2.h"
 #include "common.h"
 #include "vxl.h"
+#include "timing.h"
+#include "trace.h"
+#include "scene.h"
+#include "latency.h"
 
 struct globals {
 	SDL_Window* window;
@@ -11,9 +15,22 @@ struct globals {
 	int screen_height;
 	float pixel_ratio;
 
-	u32* im;
-	int im_width;
-	int im_height;
+	// the part of the vxl bitmap that's shown; may extend outside it
+	int view_x0;
+	int view_y0;
+	int view_width;
+	int view_height;
+
+	// view position at the last present_view(), or -1 to upload all
+	int presented_x0;
+	int presented_y0;
+
+	struct timing timing;
+	struct latency latency;
+	// glFinish() after each swap; see LATENCY_FINISH in main()
+	int finish_frames;
+	int show_overlay;
+	u32 overlay[TIMING_OVERLAY_WIDTH * TIMING_OVERLAY_HEIGHT];
 } g;
 
 static void populate_screen_globals()
@@ -33,36 +50,79 @@ static void populate_screen_globals()
 	}
 }
 
-static void clearscr()
+// shows the view into the vxl bitmap; only the parts damaged since the last
+// call are uploaded, unless the view moved
+static void present_view(struct gfx* gfx, struct vxl* vxl)
 {
-	memset(g.im, 0, g.im_width * g.im_height * sizeof(*g.im));
+	struct px_rect rects[VXL_MAX_DAMAGE];
+	int n_rects = 0;
+	if (g.view_x0 != g.presented_x0 || g.view_y0 != g.presented_y0) {
+		struct px_rect r = {0, 0, g.view_width, g.view_height};
+		rects[n_rects++] = r;
+		g.presented_x0 = g.view_x0;
+		g.presented_y0 = g.view_y0;
+	} else {
+		for (int i = 0; i < vxl->n_damage; i++) {
+			struct vxl_rect* d = &vxl->damage[i];
+			struct px_rect r = {d->x0 - g.view_x0, d->y0 - g.view_y0, d->x1 - d->x0, d->y1 - d->y0};
+			rects[n_rects++] = r;
+		}
+	}
+	vxl_clear_damage(vxl);
+
+	struct px_source src;
+	src.pixels = vxl->bitmap;
+	src.stride = vxl->bitmap_width;
+	src.width = vxl->bitmap_width;
+	src.height = vxl->bitmap_height;
+	src.x0 = g.view_x0;
+	src.y0 = g.view_y0;
+	px_present(&gfx->px, g.true_screen_width, g.true_screen_height, g.view_width, g.view_height, &src, rects, n_rects);
 }
 
-static void vblit(struct vxl* vxl, int src_x0, int src_y0)
+static void dump_trace(const char* path)
 {
-	clearscr();
-	int dst_w = g.im_width;
-	int dst_h = g.im_height;
-	int src_w = vxl->bitmap_width;
-	int src_h = vxl->bitmap_height;
-
-	u32* dst = g.im;
-	for (int y = 0; y < dst_h; y++) {
-		for (int x = 0; x < dst_w; x++) {
-			int src_x = src_x0 + x;
-			int src_y = src_y0 + y;
-			u32 src;
-			if (src_x < 0 || src_x >= src_w || src_y < 0 || src_y >= src_h) {
-				src = 0;
-			} else {
-				src = vxl->bitmap[src_x + src_y*src_w];
-			}
+	int n = trace_dump(path);
+	if (n < 0) {
+		fprintf(stderr, "could not write trace to %s\n", path);
+	} else {
+		printf("wrote %d trace spans to %s\n", n, path);
+	}
+}
 
-			*dst = src;
+// when SDL queued the event, in trace_now_ns() time; SDL timestamps are
+// in milliseconds, so that's as precise as it gets
+static s64 event_time(const SDL_Event* e)
+{
+	const s64 now = trace_now_ns();
+	const Uint32 age_ms = SDL_GetTicks() - e->common.timestamp;
+	return now - (s64)age_ms * 1000000;
+}
 
-			dst++;
-		}
+// draws the timing overlay in the top left corner at an integer scale. the
+// text is redrawn every 16 frames; any faster and the numbers can't be read
+static void present_overlay(struct px* px, int iteration)
+{
+	const int w = TIMING_OVERLAY_WIDTH;
+	const int h = TIMING_OVERLAY_HEIGHT;
+	struct px_rect all = {0, 0, w, h};
+	int n_rects = 0;
+	if ((iteration & 15) == 0) {
+		timing_draw_overlay(&g.timing, g.overlay);
+		n_rects = 1;
 	}
+
+	struct px_source src;
+	src.pixels = g.overlay;
+	src.stride = w;
+	src.width = w;
+	src.height = h;
+	src.x0 = 0;
+	src.y0 = 0;
+	const int scale = MAX(1, (int)(g.pixel_ratio * 2.0f));
+	glViewport(0, g.true_screen_height - h*scale, w*scale, h*scale);
+	px_present(px, w*scale, h*scale, w, h, &src, &all, n_rects);
+	glViewport(0, 0, g.true_screen_width, g.true_screen_height);
 }
 
 int main(int argc, char** argv)
@@ -103,60 +163,103 @@ int main(int argc, char** argv)
 
 	struct gfx gfx;
 	gfx_init(&gfx);
+	struct px overlay_px;
+	px_init(&overlay_px);
+	timing_init(&g.timing);
+	g.show_overlay = 1;
+
+	// rotations (q/e, not key repeats) are timed until the frame they went
+	// into is flushed and swapped, along with the vxl work of handling them
+	// and of that frame's flush; other keys and scene_frame()'s edits
+	// aren't. 'l' and exiting print the histograms (see INPUT LATENCY in
+	// latency.h). LATENCY_FINISH=1 also waits for GL to finish each frame
+	// after the swap, and times that
+	latency_init(&g.latency);
+	g.finish_frames = getenv("LATENCY_FINISH") != NULL && atoi(getenv("LATENCY_FINISH")) != 0;
+
+	// TRACE=<path> records trace spans from the start; otherwise 'p'
+	// starts recording to trace.json. 'p' while recording stops recording
+	// and writes the trace, as does exiting while recording. the rings
+	// keep their spans, so a later recording's trace has those too; see
+	// TRACE SPANS in trace.h
+	const char* trace_path = getenv("TRACE");
+	if (trace_path != NULL) trace_enable(1);
+	trace_name_thread("main");
 
 	populate_screen_globals();
 
 	{
-		g.im_width = 1920/4;
-		g.im_height = 1080/4;
-		size_t sz = g.im_width * g.im_height * sizeof(*g.im);
-		g.im = malloc(sz);
-		assert(g.im != NULL);
-		clearscr();
+		g.view_width = 1920/4;
+		g.view_height = 1080/4;
+		g.presented_x0 = g.presented_y0 = -1;
 	}
 
 	struct vxl vxl;
-	const int vxl_dx = 128;
-	const int vxl_dy = 128;
-	const int vxl_dz = 32;
 	{
 
-		vxl_init(&vxl, vxl_dx, vxl_dy, vxl_dz);
-		vxl_set_full_update(&vxl);
-		vxl_set_rotation(&vxl, 0);
+		vxl_init(&vxl, SCENE_DIM_X, SCENE_DIM_Y, SCENE_DIM_Z, VXL_CACHE_ROTATIONS);
 
-		// XXX debug drawing
-		for (int y = 0; y < vxl_dy; y++) {
-			for (int x = 0; x < vxl_dx; x++) {
-				float f = sinf((float)x * 0.05f) * sinf((float)y * 0.07);
-				int h = 5 + (int)((f+1.0f) * 10.0f);
-				h = MAX(h, 0);
-				h = MIN(h, vxl_dz);
-				const int mid = 24;
-				const int is_mid = x >= (vxl_dx-mid)/2 && x <= (vxl_dx+mid)/2 && y >= (vxl_dy-mid)/2 && y <= (vxl_dy+mid)/2;
-				if (is_mid) h = vxl_dz-1;
-				for (int z = 0; z < h; z++) {
-					vxl_put(&vxl, x, y, z, 1);
-				}
+		// VERIFY=<n> checks every n'th flush against a render from
+		// scratch; see vxl_set_verify() in vxl.h
+		const char* verify = getenv("VERIFY");
+		if (verify != NULL) vxl_set_verify(&vxl, atoi(verify));
+
+		// RECORD=<path> records the session for ./replay; see
+		// RECORDINGS in vxl.h
+		const char* record_path = getenv("RECORD");
+		if (record_path != NULL) {
+			FILE* f = fopen(record_path, "wb");
+			if (f != NULL) {
+				vxl_record(&vxl, f);
+			} else {
+				fprintf(stderr, "could not write recording to %s\n", record_path);
 			}
 		}
+		vxl_set_full_update(&vxl);
+		vxl_set_rotation(&vxl, 0);
+
+		scene_draw(&vxl);
 	}
 
 	int exiting = 0;
 	int fullscreen = 0;
 	int iteration = 0;
 	while (!exiting) {
+		const s64 trace_frame = trace_begin();
+		timing_frame(&g.timing);
+		const struct vxl_stats stats0 = vxl.stats;
+
 		SDL_Event e;
 		while (SDL_PollEvent(&e)) {
 			if (e.type == SDL_QUIT) {
 				exiting = 1;
 			} else if (e.type == SDL_KEYDOWN) {
+				const int sym = e.key.keysym.sym;
+				if ((sym == SDLK_q || sym == SDLK_e) && !e.key.repeat) {
+					latency_input(&g.latency, event_time(&e));
+				}
 				if (e.key.keysym.sym == SDLK_ESCAPE) {
 					exiting = 1;
 				} else if (e.key.keysym.sym == SDLK_f) {
 					fullscreen = !fullscreen;
 					//SDL_SetWindowFullscreen(g.window, fullscreen ? SDL_WINDOW_FULLSCREEN : 0);
 					SDL_SetWindowFullscreen(g.window, fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
+				} else if (e.key.keysym.sym == SDLK_q) {
+					vxl_set_rotation(&vxl, vxl.rotation + 1);
+				} else if (e.key.keysym.sym == SDLK_e) {
+					vxl_set_rotation(&vxl, vxl.rotation - 1);
+				} else if (e.key.keysym.sym == SDLK_t) {
+					g.show_overlay = !g.show_overlay;
+				} else if (e.key.keysym.sym == SDLK_l) {
+					latency_print(&g.latency, stdout);
+				} else if (e.key.keysym.sym == SDLK_p) {
+					if (trace_enabled) {
+						dump_trace(trace_path);
+						trace_enable(0);
+					} else {
+						if (trace_path == NULL) trace_path = "trace.json";
+						trace_enable(1);
+					}
 				}
 			} else if (e.type == SDL_WINDOWEVENT) {
 				if (e.window.event == SDL_WINDOWEVENT_RESIZED) {
@@ -164,6 +267,7 @@ int main(int argc, char** argv)
 				}
 			}
 		}
+		latency_work(&g.latency, &stats0, &vxl.stats);
 
 		glViewport(0, 0, g.true_screen_width, g.true_screen_height);
 		glClearColor(0, 0, 0.2, 1);
@@ -176,44 +280,52 @@ int main(int argc, char** argv)
 
 		//vxl_set_full_update(&vxl);
 
-		for (int y = 0; y < vxl_dy; y++) {
-			for (int x = 0; x < vxl_dx; x++) {
-				{
-					const int mid = 24;
-					const int is_mid = x >= (vxl_dx-mid)/2 && x <= (vxl_dx+mid)/2 && y >= (vxl_dy-mid)/2 && y <= (vxl_dy+mid)/2;
-					if (is_mid) {
-						int h = (iteration >> 2) & (vxl_dz-1);
-						for (int z = 0; z < vxl_dz; z++) {
-							vxl_put(&vxl, x, y, z, z < h ? 1 : 0);
-						}
-					}
-				}
-				{
-					const int mid = 12;
-					const int is_mid = x >= (vxl_dx-mid)/2 && x <= (vxl_dx+mid)/2 && y >= (vxl_dy-mid)/2 && y <= (vxl_dy+mid)/2;
-					if (is_mid) {
-						int h = (iteration >> 3) & (vxl_dz-1);
-						for (int z = 0; z < vxl_dz; z++) {
-							vxl_put(&vxl, x, y, z, z < h ? 1 : 0);
-						}
-					}
-				}
-			}
-		}
-
+		scene_frame(&vxl, iteration);
 
+		const struct vxl_stats flush_stats0 = vxl.stats;
 		vxl_flush(&vxl);
-		printf("frame %d\n", iteration); // XXX
+		timing_add_vxl(&g.timing, &stats0, &vxl.stats);
+		latency_work(&g.latency, &flush_stats0, &vxl.stats);
+		latency_stage(&g.latency, LATENCY_FLUSHED);
 
-		vblit(&vxl, 0, 0);
+		timing_begin(&g.timing);
+		s64 trace_t0 = trace_begin();
+		present_view(&gfx, &vxl);
+		trace_end("present", trace_t0);
+		timing_end(&g.timing, TIMING_PRESENT);
 
-		px_present(&gfx.px, g.true_screen_width, g.true_screen_height, g.im_width, g.im_height, g.im);
+		if (g.show_overlay) present_overlay(&overlay_px, iteration);
 
+		timing_begin(&g.timing);
+		trace_t0 = trace_begin();
 		SDL_GL_SwapWindow(g.window);
+		trace_end("swap", trace_t0);
+		timing_end(&g.timing, TIMING_SWAP);
+		latency_stage(&g.latency, LATENCY_SWAPPED);
+
+		if (g.finish_frames) {
+			trace_t0 = trace_begin();
+			glFinish();
+			trace_end("finish", trace_t0);
+			latency_stage(&g.latency, LATENCY_FINISHED);
+		}
+
+		// frames with input are told apart in traces
+		trace_end(latency_pending(&g.latency) ? "frame with input" : "frame", trace_frame);
+		latency_frame(&g.latency);
 
 		iteration++;
 	}
 
+	if (trace_enabled) dump_trace(trace_path);
+	if (g.latency.n_frames > 0) latency_print(&g.latency, stdout);
+
+	if (vxl.record != NULL) {
+		FILE* f = vxl.record;
+		vxl_record(&vxl, NULL);
+		fclose(f);
+	}
+
 	SDL_GL_DeleteContext(glctx);
 	SDL_DestroyWindow(g.window);
 
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perf.h"
+#include "trace.h"
+#include "common.h"
+
+static const char* counter_names[PERF_N_COUNTERS] = {
+	"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses",
+};
+
+static const char* phase_names[PERF_N_PHASES] = {
+	"faces", "render", "queue",
+};
+
+#ifdef __linux__
+static int open_counter(u32 type, u64 config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = 1;
+	// the PMU may have fewer counters than we ask for, in which case the
+	// kernel multiplexes them, and counts are scaled up by these
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+void perf_init(struct perf* perf)
+{
+	memset(perf, 0, sizeof *perf);
+	for (int i = 0; i < PERF_N_COUNTERS; i++) perf->fds[i] = -1;
+
+	#ifdef __linux__
+	static const struct { u32 type; u64 config; } events[PERF_N_COUNTERS] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HW_CACHE,
+			PERF_COUNT_HW_CACHE_L1D
+			| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	};
+	for (int i = 0; i < PERF_N_COUNTERS; i++) {
+		perf->fds[i] = open_counter(events[i].type, events[i].config);
+		if (perf->fds[i] >= 0) perf->n_counters++;
+	}
+	#endif
+
+	#ifdef DEBUG
+	printf("perf: %d of %d counters\n", perf->n_counters, PERF_N_COUNTERS);
+	#endif
+}
+
+void perf_free(struct perf* perf)
+{
+	for (int i = 0; i < PERF_N_COUNTERS; i++) {
+		if (perf->fds[i] >= 0) close(perf->fds[i]);
+		perf->fds[i] = -1;
+	}
+	perf->n_counters = 0;
+}
+
+void perf_reset(struct perf* perf)
+{
+	memset(perf->phases, 0, sizeof perf->phases);
+}
+
+// count scaled for multiplexing, or 0 if unavailable
+static u64 read_counter(int fd)
+{
+	u64 v[3];
+	if (fd < 0 || read(fd, v, sizeof v) != sizeof v || v[2] == 0) return 0;
+	if (v[1] == v[2]) return v[0];
+	return (u64)((double)v[0] * (double)v[1] / (double)v[2]);
+}
+
+void perf_start(struct perf* perf)
+{
+	for (int i = 0; i < PERF_N_COUNTERS; i++) perf->counts0[i] = read_counter(perf->fds[i]);
+	perf->t0 = trace_now_ns();
+}
+
+void perf_stop(struct perf* perf, int phase, s64 n_voxels)
+{
+	struct perf_phase* p = &perf->phases[phase];
+	p->ns += trace_now_ns() - perf->t0;
+	for (int i = 0; i < PERF_N_COUNTERS; i++) p->counts[i] += read_counter(perf->fds[i]) - perf->counts0[i];
+	p->n_voxels += n_voxels;
+}
+
+void perf_report(struct perf* perf, FILE* f, const char* label)
+{
+	for (int i = 0; i < PERF_N_PHASES; i++) {
+		const struct perf_phase* p = &perf->phases[i];
+		if (p->ns == 0) continue;
+		fprintf(f, "# perf %s %s: %.3f ms, %lld voxels", label, phase_names[i], (double)p->ns * 1e-6, (long long)p->n_voxels);
+		if (p->n_voxels == 0) {
+			fprintf(f, "\n");
+			continue;
+		}
+		const double n = (double)p->n_voxels;
+		fprintf(f, ", %.2f ns/voxel", (double)p->ns / n);
+		if (perf->n_counters == 0) {
+			fprintf(f, "; no counters\n");
+			continue;
+		}
+		const char* sep = "; per voxel: ";
+		for (int j = 0; j < PERF_N_COUNTERS; j++) {
+			if (perf->fds[j] < 0) continue;
+			fprintf(f, "%s%.2f %s", sep, (double)p->counts[j] / n, counter_names[j]);
+			sep = ", ";
+		}
+		if (perf->fds[PERF_CYCLES] >= 0 && perf->fds[PERF_INSTRUCTIONS] >= 0 && p->counts[PERF_CYCLES] > 0) {
+			fprintf(f, " (ipc %.2f)", (double)p->counts[PERF_INSTRUCTIONS] / (double)p->counts[PERF_CYCLES]);
+		}
+		fprintf(f, "\n");
+	}
+}
@@ -0,0 +1,75 @@
+#ifndef PERF_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+/*
+
+PERF COUNTERS
+
+struct perf counts hardware events (Linux perf_event_open(), no libraries)
+per vxl_flush() phase: set vxl->perf to one and each flush adds its phases'
+time, counters and voxels processed. Counters the kernel won't open (in
+containers, VMs, under a high perf_event_paranoid, or off Linux) are
+skipped, down to timing only. Counters follow the thread that called
+perf_init() and the threads it starts later, so call it before
+vxl_set_threads().
+
+*/
+
+#define PERF_CYCLES        (0)
+#define PERF_INSTRUCTIONS  (1)
+#define PERF_L1D_MISSES    (2)
+#define PERF_LLC_MISSES    (3)
+#define PERF_BRANCH_MISSES (4)
+#define PERF_N_COUNTERS    (5)
+
+#define PERF_FACES  (0) // shade pass; voxels are faces updated
+#define PERF_RENDER (1) // diagonal rendering; voxels are diagonals
+#define PERF_QUEUE  (2) // sorting dirty sets, damage, occupancy rebuilds; voxels are those queued
+#define PERF_N_PHASES (3)
+
+struct perf_phase {
+	s64 ns;
+	u64 counts[PERF_N_COUNTERS];
+	s64 n_voxels;
+};
+
+struct perf {
+	// -1 for counters that couldn't be opened
+	int fds[PERF_N_COUNTERS];
+	int n_counters;
+
+	s64 t0;
+	u64 counts0[PERF_N_COUNTERS];
+
+	struct perf_phase phases[PERF_N_PHASES];
+};
+
+void perf_init(struct perf* perf);
+void perf_free(struct perf* perf);
+
+// clears the phases
+void perf_reset(struct perf* perf);
+
+void perf_start(struct perf* perf);
+void perf_stop(struct perf* perf, int phase, s64 n_voxels);
+
+// a line per phase that ran, totals and per voxel, each prefixed by "#
+// perf <label>"
+void perf_report(struct perf* perf, FILE* f, const char* label);
+
+// perf_start()/perf_stop() if perf isn't NULL. phases mustn't nest
+static inline void perf_begin(struct perf* perf)
+{
+	if (perf != NULL) perf_start(perf);
+}
+
+static inline void perf_end(struct perf* perf, int phase, s64 n_voxels)
+{
+	if (perf != NULL) perf_stop(perf, phase, n_voxels);
+}
+
+#define PERF_H
+#endif
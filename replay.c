@@ -0,0 +1,313 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vxl.h"
+#include "timing.h"
+#include "trace.h"
+#include "perf.h"
+#include "common.h"
+
+/*
+
+HEADLESS REPLAYER
+
+Runs a recording made with vxl_record() (see RECORDINGS in vxl.h) against
+vxl.c as fast as it can, without SDL/GL, and times every recorded
+vxl_flush():
+
+  ./replay rec.bin             # summary of the flush times
+  ./replay -v rec.bin          # also a tab-separated line per flush
+  ./replay -j 4 rec.bin        # use 4 threads in vxl_flush() (default: one per CPU)
+  ./replay -t t.json rec.bin   # also write a trace of the spans (see trace.h)
+  ./replay -p rec.bin          # also print "# perf" lines (see perf.h)
+  ./replay -V 1 rec.bin        # check every flush against a render from scratch
+
+-V n runs the shadow verification (see vxl_set_verify() in vxl.h) every n'th
+flush, which makes those flushes look slow; replay fails if any pixel was
+wrong.
+
+The recording is read into memory first, so reading it isn't timed.
+
+*/
+
+struct reader {
+	const u8* p;
+	const u8* end;
+};
+
+static void need(struct reader* r, size_t n)
+{
+	if ((size_t)(r->end - r->p) >= n) return;
+	fprintf(stderr, "recording ends in the middle of an op\n");
+	exit(EXIT_FAILURE);
+}
+
+static int get_u8(struct reader* r)
+{
+	need(r, 1);
+	return *r->p++;
+}
+
+static int get_u16(struct reader* r)
+{
+	need(r, 2);
+	const int v = r->p[0] | (r->p[1] << 8);
+	r->p += 2;
+	return v;
+}
+
+static s32 get_s32(struct reader* r)
+{
+	need(r, 4);
+	const u32 v = (u32)r->p[0] | ((u32)r->p[1] << 8) | ((u32)r->p[2] << 16) | ((u32)r->p[3] << 24);
+	r->p += 4;
+	return (s32)v;
+}
+
+static const u8* get_bytes(struct reader* r, s32 n)
+{
+	if (n < 0) n = 0;
+	need(r, n);
+	const u8* p = r->p;
+	r->p += n;
+	return p;
+}
+
+static u8* read_file(const char* path, size_t* size)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) return NULL;
+	size_t cap = 1 << 20;
+	size_t n = 0;
+	u8* data;
+	assert((data = malloc(cap)) != NULL);
+	for (;;) {
+		n += fread(data + n, 1, cap - n, f);
+		if (n < cap) break;
+		cap *= 2;
+		assert((data = realloc(data, cap)) != NULL);
+	}
+	fclose(f);
+	*size = n;
+	return data;
+}
+
+// one timed vxl_flush()
+struct flush_time {
+	s64 ns;
+	int full;
+	s64 n_shaded;
+	s64 n_rendered;
+};
+
+int main(int argc, char** argv)
+{
+	int n_threads = 0;
+	int verbose = 0;
+	int verify_interval = 0;
+	const char* trace_path = NULL;
+	struct perf perf_counters;
+	struct perf* perf = NULL;
+	for (;;) {
+		if (argc >= 2 && strcmp(argv[1], "-v") == 0) {
+			verbose = 1;
+			argv[1] = argv[0];
+			argc--;
+			argv++;
+			continue;
+		}
+		if (argc >= 2 && strcmp(argv[1], "-p") == 0 && perf == NULL) {
+			perf_init(&perf_counters);
+			perf = &perf_counters;
+			argv[1] = argv[0];
+			argc--;
+			argv++;
+			continue;
+		}
+		if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+			n_threads = atoi(argv[2]);
+		} else if (argc >= 3 && strcmp(argv[1], "-V") == 0) {
+			verify_interval = atoi(argv[2]);
+		} else if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+			trace_path = argv[2];
+			trace_enable(1);
+			trace_name_thread("replay");
+		} else {
+			break;
+		}
+		argv[2] = argv[0];
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s [-v] [-p] [-j threads] [-t trace.json] [-V interval] <recording>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	size_t size;
+	u8* data = read_file(argv[1], &size);
+	if (data == NULL) {
+		fprintf(stderr, "%s: can't read\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	struct reader r = {data, data + size};
+
+	struct vxl vxl;
+	int have_vxl = 0;
+	int cap = 1024;
+	int n_flushes = 0;
+	struct flush_time* flushes;
+	assert((flushes = malloc(cap * sizeof *flushes)) != NULL);
+	s64 n_ops = 0;
+	int n_verified = 0;
+	s64 n_verify_mismatches = 0;
+
+	if (verbose) printf("flush\tfull\tms\tshaded\trendered\n");
+
+	const s64 t0 = trace_now_ns();
+	while (r.p < r.end) {
+		const int op = get_u8(&r);
+		n_ops++;
+		if (op != VXL_OP_INIT && !have_vxl) {
+			fprintf(stderr, "op '%c' before VXL_OP_INIT\n", op);
+			return EXIT_FAILURE;
+		}
+		switch (op) {
+		case VXL_OP_INIT: {
+			s32 a[4];
+			for (int i = 0; i < 4; i++) a[i] = get_s32(&r);
+			if (have_vxl) {
+				n_verified += vxl.stats.n_verified;
+				n_verify_mismatches += vxl.stats.n_verify_mismatches;
+				vxl_free(&vxl);
+			}
+			vxl_init(&vxl, a[0], a[1], a[2], a[3]);
+			vxl_set_threads(&vxl, n_threads);
+			vxl.perf = perf;
+			vxl_set_verify(&vxl, verify_interval);
+			have_vxl = 1;
+			break;
+		}
+		case VXL_OP_PALETTE: {
+			u32 palette[256];
+			for (int i = 0; i < 256; i++) palette[i] = get_s32(&r);
+			vxl_set_palette(&vxl, palette);
+			break;
+		}
+		case VXL_OP_ROTATION:
+			vxl_set_rotation(&vxl, get_s32(&r));
+			break;
+		case VXL_OP_FULL_UPDATE:
+			vxl_set_full_update(&vxl);
+			break;
+		case VXL_OP_SETUP:
+			vxl_flush(&vxl);
+			n_verified += vxl.stats.n_verified;
+			n_verify_mismatches += vxl.stats.n_verify_mismatches;
+			memset(&vxl.stats, 0, sizeof vxl.stats);
+			if (perf != NULL) perf_reset(perf);
+			break;
+		case VXL_OP_FLUSH: {
+			struct flush_time* f;
+			if (n_flushes == cap) {
+				cap *= 2;
+				assert((flushes = realloc(flushes, cap * sizeof *flushes)) != NULL);
+			}
+			f = &flushes[n_flushes];
+			const struct vxl_stats s0 = vxl.stats;
+			f->full = vxl.full_update;
+			const s64 t1 = trace_now_ns();
+			vxl_flush(&vxl);
+			f->ns = trace_now_ns() - t1;
+			f->n_shaded = vxl.stats.n_shaded - s0.n_shaded;
+			f->n_rendered = vxl.stats.n_rendered - s0.n_rendered;
+			if (verbose) {
+				printf("%d\t%d\t%.3f\t%lld\t%lld\n", n_flushes, f->full, (double)f->ns * 1e-6,
+					(long long)f->n_shaded, (long long)f->n_rendered);
+			}
+			n_flushes++;
+			break;
+		}
+		case VXL_OP_PUT: {
+			const int x = get_u16(&r);
+			const int y = get_u16(&r);
+			const int z = get_u16(&r);
+			vxl_put(&vxl, x, y, z, get_u8(&r));
+			break;
+		}
+		case VXL_OP_FILL_BOX: {
+			s32 a[6];
+			for (int i = 0; i < 6; i++) a[i] = get_s32(&r);
+			vxl_fill_box(&vxl, a[0], a[1], a[2], a[3], a[4], a[5], get_u8(&r));
+			break;
+		}
+		case VXL_OP_PUT_SPAN:
+		case VXL_OP_PUT_COLUMN: {
+			s32 a[4];
+			for (int i = 0; i < 4; i++) a[i] = get_s32(&r);
+			const u8* values = get_bytes(&r, a[3]);
+			if (op == VXL_OP_PUT_SPAN) {
+				vxl_put_span(&vxl, a[0], a[1], a[2], a[3], values);
+			} else {
+				vxl_put_column(&vxl, a[0], a[1], a[2], a[3], values);
+			}
+			break;
+		}
+		default:
+			fprintf(stderr, "unknown op 0x%.2x at byte %zu\n", op, (size_t)(r.p - 1 - data));
+			return EXIT_FAILURE;
+		}
+	}
+	const s64 total_ns = trace_now_ns() - t0;
+
+	s64 flush_ns = 0;
+	int n_full = 0;
+	int slowest = 0;
+	s64* flush_times;
+	assert((flush_times = malloc(MAX(n_flushes, 1) * sizeof *flush_times)) != NULL);
+	for (int i = 0; i < n_flushes; i++) {
+		flush_ns += flushes[i].ns;
+		n_full += flushes[i].full;
+		if (flushes[i].ns > flushes[slowest].ns) slowest = i;
+		flush_times[i] = flushes[i].ns;
+	}
+	const struct timing_summary s = timing_summarize_values(flush_times, n_flushes);
+
+	printf("ops\tflushes\tfull_flushes\ttotal_ms\tflush_ms\tmin_ms\tavg_ms\tp99_ms\tmax_ms\tslowest\n");
+	printf("%lld\t%d\t%d\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%d\n",
+		(long long)n_ops, n_flushes, n_full,
+		(double)total_ns * 1e-6,
+		(double)flush_ns * 1e-6,
+		(double)s.min * 1e-6,
+		(double)s.avg * 1e-6,
+		(double)s.p99 * 1e-6,
+		(double)s.max * 1e-6,
+		n_flushes > 0 ? slowest : -1);
+	if (perf != NULL) {
+		perf_report(perf, stdout, argv[1]);
+		perf_free(perf);
+	}
+
+	if (have_vxl) {
+		n_verified += vxl.stats.n_verified;
+		n_verify_mismatches += vxl.stats.n_verify_mismatches;
+		vxl_free(&vxl);
+	}
+	if (verify_interval > 0) {
+		printf("# verify: %d flushes checked, %lld pixels wrong\n", n_verified, (long long)n_verify_mismatches);
+	}
+	free(flush_times);
+	free(flushes);
+	free(data);
+
+	if (trace_path != NULL && trace_dump(trace_path) < 0) {
+		fprintf(stderr, "could not write trace to %s\n", trace_path);
+		return EXIT_FAILURE;
+	}
+
+	return n_verify_mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
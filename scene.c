@@ -0,0 +1,48 @@
+#include <math.h>
+
+#include "scene.h"
+#include "common.h"
+
+void scene_draw(struct vxl* vxl)
+{
+	const int dx = vxl->dim_x;
+	const int dy = vxl->dim_y;
+	const int dz = vxl->dim_z;
+	for (int y = 0; y < dy; y++) {
+		for (int x = 0; x < dx; x++) {
+			float f = sinf((float)x * 0.05f) * sinf((float)y * 0.07);
+			int h = 5 + (int)((f+1.0f) * 10.0f);
+			h = MAX(h, 0);
+			h = MIN(h, dz);
+			const int mid = 24;
+			const int is_mid = x >= (dx-mid)/2 && x <= (dx+mid)/2 && y >= (dy-mid)/2 && y <= (dy+mid)/2;
+			if (is_mid) h = dz-1;
+			for (int z = 0; z < h; z++) {
+				vxl_put(vxl, x, y, z, 1);
+			}
+		}
+	}
+}
+
+void scene_frame(struct vxl* vxl, int iteration)
+{
+	const int dx = vxl->dim_x;
+	const int dy = vxl->dim_y;
+	const int dz = vxl->dim_z;
+	{
+		const int mid = 24;
+		const int x0 = (dx-mid)/2, x1 = (dx+mid)/2 + 1;
+		const int y0 = (dy-mid)/2, y1 = (dy+mid)/2 + 1;
+		int h = (iteration >> 2) & (dz-1);
+		vxl_fill_box(vxl, x0, y0, 0, x1, y1, h, 1);
+		vxl_fill_box(vxl, x0, y0, h, x1, y1, dz, 0);
+	}
+	{
+		const int mid = 12;
+		const int x0 = (dx-mid)/2, x1 = (dx+mid)/2 + 1;
+		const int y0 = (dy-mid)/2, y1 = (dy+mid)/2 + 1;
+		int h = (iteration >> 3) & (dz-1);
+		vxl_fill_box(vxl, x0, y0, 0, x1, y1, h, 1);
+		vxl_fill_box(vxl, x0, y0, h, x1, y1, dz, 0);
+	}
+}
@@ -0,0 +1,25 @@
+#ifndef SCENE_H
+
+#include "vxl.h"
+
+/*
+
+DEMO SCENE
+
+The world main.c shows, and the edits it makes every frame; headless.c
+renders the same frames without a window.
+
+*/
+
+#define SCENE_DIM_X (128)
+#define SCENE_DIM_Y (128)
+#define SCENE_DIM_Z (32)
+
+// draws the terrain into an empty SCENE_DIM_X × SCENE_DIM_Y × SCENE_DIM_Z vxl
+void scene_draw(struct vxl* vxl);
+
+// the edits of frame number iteration: two towers in the middle rising
+void scene_frame(struct vxl* vxl, int iteration);
+
+#define SCENE_H
+#endif
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing.h"
+#include "vxl.h"
+#include "common.h"
+#include "stb_sprintf.h"
+
+const char* timing_series_names[TIMING_N_SERIES] = {
+	"frame", "faces", "render", "present", "swap",
+	"puts", "rendered", "forced",
+};
+
+void timing_init(struct timing* t)
+{
+	memset(t, 0, sizeof *t);
+}
+
+void timing_frame(struct timing* t)
+{
+	const s64 now = trace_now_ns();
+	if (t->frame_t0 != 0) {
+		t->current[TIMING_FRAME] = now - t->frame_t0;
+		memcpy(t->frames[t->n_frames % TIMING_FRAMES], t->current, sizeof t->current);
+		t->n_frames++;
+	}
+	memset(t->current, 0, sizeof t->current);
+	t->frame_t0 = now;
+}
+
+void timing_add_vxl(struct timing* t, const struct vxl_stats* s0, const struct vxl_stats* s1)
+{
+	timing_add(t, TIMING_FACES, s1->faces_ns - s0->faces_ns);
+	timing_add(t, TIMING_RENDER, s1->render_ns - s0->render_ns);
+	timing_add(t, TIMING_PUTS, s1->n_put - s0->n_put);
+	timing_add(t, TIMING_RENDERED, s1->n_rendered - s0->n_rendered);
+	timing_add(t, TIMING_FORCED, s1->n_forced_flushes - s0->n_forced_flushes);
+}
+
+static int s64cmp(const void* va, const void* vb)
+{
+	const s64 a = *(const s64*)va;
+	const s64 b = *(const s64*)vb;
+	return (a > b) - (a < b);
+}
+
+struct timing_summary timing_summarize_values(const s64* values, int n)
+{
+	struct timing_summary s = {0};
+	if (n <= 0) return s;
+
+	s64* sorted;
+	assert((sorted = malloc(n * sizeof *sorted)) != NULL);
+	s64 sum = 0;
+	for (int i = 0; i < n; i++) {
+		sorted[i] = values[i];
+		sum += values[i];
+	}
+	qsort(sorted, n, sizeof *sorted, s64cmp);
+	s.min = sorted[0];
+	s.avg = sum / n;
+	s.p99 = sorted[(n*99) / 100];
+	s.max = sorted[n-1];
+	free(sorted);
+	return s;
+}
+
+struct timing_summary timing_summarize(struct timing* t, int series)
+{
+	const int n = MIN(t->n_frames, TIMING_FRAMES);
+	s64 values[TIMING_FRAMES];
+	for (int i = 0; i < n; i++) values[i] = t->frames[i][series];
+	return timing_summarize_values(values, n);
+}
+
+/*
+
+OVERLAY
+
+Text is drawn with a 3×5 font in 4×6 cells. A glyph is five octal digits,
+one per row from the top, whose bits are the row's pixels from the left.
+
+*/
+
+#define GLYPH_W (3)
+#define GLYPH_H (5)
+#define CELL_W (GLYPH_W+1)
+#define CELL_H (GLYPH_H+1)
+
+static const char glyph_chars[] = "0123456789abcdefghijklmnopqrstuvwxyz.-/:%";
+static const u16 glyphs[] = {
+	075557, 026227, 071747, 071717, 055711, 074717, 074757, 071222, 075757, 075717,
+	025755, 065656, 034443, 065556, 074647, 074644, 034553, 055755, 072227, 011152,
+	055655, 044447, 057755, 065555, 025552, 065644, 025563, 065655, 034216, 072222,
+	055557, 055552, 055775, 055255, 055222, 071247,
+	000002, 000700, 011244, 002020, 051245,
+};
+
+#define OVERLAY_TEXT (0xffffffff)
+#define OVERLAY_BACKGROUND (0xa0000000)
+
+// draws s at cell [cx,cy]; characters without a glyph are blank
+static void draw_text(u32* pixels, int cx, int cy, const char* s)
+{
+	for (; *s; s++, cx++) {
+		if (*s == ' ') continue;
+		const char* p = strchr(glyph_chars, *s | 0x20);
+		if (p == NULL || *p == 0) continue;
+		const u16 glyph = glyphs[p - glyph_chars];
+		for (int y = 0; y < GLYPH_H; y++) {
+			const int py = 1 + cy*CELL_H + y;
+			if (py >= TIMING_OVERLAY_HEIGHT) return;
+			const int row = (glyph >> (3*(GLYPH_H-1-y))) & 7;
+			for (int x = 0; x < GLYPH_W; x++) {
+				const int px = 1 + cx*CELL_W + x;
+				if (px >= TIMING_OVERLAY_WIDTH) return;
+				if (row & (4 >> x)) pixels[px + py*TIMING_OVERLAY_WIDTH] = OVERLAY_TEXT;
+			}
+		}
+	}
+}
+
+void timing_draw_overlay(struct timing* t, u32* pixels)
+{
+	for (int i = 0; i < TIMING_OVERLAY_WIDTH * TIMING_OVERLAY_HEIGHT; i++) pixels[i] = OVERLAY_BACKGROUND;
+
+	char line[64];
+	stbsp_snprintf(line, sizeof line, "%-8s%7s%7s%7s", "ms", "min", "avg", "p99");
+	draw_text(pixels, 0, 0, line);
+	for (int i = 0; i < TIMING_N_SERIES; i++) {
+		struct timing_summary s = timing_summarize(t, i);
+		if (i < TIMING_N_PHASES) {
+			stbsp_snprintf(line, sizeof line, "%-8s%7.2f%7.2f%7.2f", timing_series_names[i], s.min * 1e-6, s.avg * 1e-6, s.p99 * 1e-6);
+		} else {
+			stbsp_snprintf(line, sizeof line, "%-8s%7lld%7lld%7lld", timing_series_names[i], (long long)s.min, (long long)s.avg, (long long)s.p99);
+		}
+		draw_text(pixels, 0, 1+i, line);
+	}
+}
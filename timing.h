@@ -0,0 +1,96 @@
+#ifndef TIMING_H
+
+#include "trace.h"
+#include "common.h"
+
+/*
+
+FRAME TIMING
+
+struct timing records a set of per frame series (phase durations and
+counters) for the last TIMING_FRAMES frames in a ring, and answers
+min/avg/p99/max queries over them. Recording is a clock read per phase and an
+add, so it can stay on in normal builds; timing_draw_overlay() renders the
+summaries as text into a small image that can be shown on top of the view.
+
+*/
+
+#define TIMING_FRAMES (256)
+
+// series; durations in nanoseconds first, then counts
+#define TIMING_FRAME    (0) // from one timing_frame() to the next
+#define TIMING_FACES    (1) // vxl_flush() updating faces
+#define TIMING_RENDER   (2) // vxl_flush() doing everything else
+#define TIMING_PRESENT  (3) // texture upload and draw
+#define TIMING_SWAP     (4) // buffer swap
+#define TIMING_N_PHASES (5)
+#define TIMING_PUTS     (5) // voxels put
+#define TIMING_RENDERED (6) // diagonals rendered
+#define TIMING_FORCED   (7) // flushes forced by rotation/full update changes
+#define TIMING_N_SERIES (8)
+
+// short lowercase names of the series, for printouts
+extern const char* timing_series_names[TIMING_N_SERIES];
+
+struct timing {
+	// frame i is frames[i % TIMING_FRAMES], for the last
+	// MIN(n_frames, TIMING_FRAMES) frames
+	s64 frames[TIMING_FRAMES][TIMING_N_SERIES];
+	int n_frames;
+
+	// the frame being recorded
+	s64 current[TIMING_N_SERIES];
+	s64 frame_t0;
+	s64 phase_t0;
+};
+
+struct timing_summary {
+	s64 min;
+	s64 avg;
+	s64 p99;
+	s64 max;
+};
+
+struct vxl_stats;
+
+// overlay image size for timing_draw_overlay()
+#define TIMING_OVERLAY_WIDTH  (120)
+#define TIMING_OVERLAY_HEIGHT (56)
+
+void timing_init(struct timing* t);
+
+// ends the frame being recorded, if any, and starts the next
+void timing_frame(struct timing* t);
+
+// over the recorded frames; all zero if there are none
+struct timing_summary timing_summarize(struct timing* t, int series);
+
+// over n values in any order; all zero if n is 0
+struct timing_summary timing_summarize_values(const s64* values, int n);
+
+// adds what a vxl did between its stats s0 and s1 to the frame being
+// recorded
+void timing_add_vxl(struct timing* t, const struct vxl_stats* s0, const struct vxl_stats* s1);
+
+// draws a line of summaries per series to a TIMING_OVERLAY_WIDTH ×
+// TIMING_OVERLAY_HEIGHT rgba image
+void timing_draw_overlay(struct timing* t, u32* pixels);
+
+// starts timing a phase; timing_end() adds the time since to a series
+static inline void timing_begin(struct timing* t)
+{
+	t->phase_t0 = trace_now_ns();
+}
+
+static inline void timing_end(struct timing* t, int series)
+{
+	t->current[series] += trace_now_ns() - t->phase_t0;
+}
+
+static inline void timing_add(struct timing* t, int series, s64 n)
+{
+	t->current[series] += n;
+}
+
+#define TIMING_H
+#endif
@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "common.h"
+
+struct trace_span {
+	const char* name;
+	s64 t0;
+	s64 t1;
+};
+
+struct trace_ring {
+	const char* name;
+	// owned by a live thread; rings of threads that exited are claimed by
+	// the next thread that needs one, and keep their spans
+	int in_use;
+	// spans recorded, including those overwritten since
+	int n;
+	struct trace_span spans[TRACE_RING];
+};
+
+int trace_enabled;
+
+static struct trace_ring* rings[TRACE_MAX_THREADS];
+static int n_rings;
+
+// threads that found no ring, and the spans they couldn't record
+static int n_dropped_threads;
+static s64 n_dropped_spans;
+
+static __thread struct trace_ring* thread_ring;
+static __thread const char* thread_name;
+static __thread int thread_has_no_ring;
+
+// gives the ring back when its thread exits
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static void release_ring(void* usr)
+{
+	struct trace_ring* ring = usr;
+	__atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_ring_key(void)
+{
+	assert(pthread_key_create(&ring_key, release_ring) == 0);
+}
+
+void trace_enable(int enable)
+{
+	trace_enabled = enable;
+}
+
+s64 trace_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (s64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// a released ring, or a new one while there are fewer than
+// TRACE_MAX_THREADS; NULL otherwise
+static struct trace_ring* claim_ring(void)
+{
+	const int n = __atomic_load_n(&n_rings, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < n; i++) {
+		struct trace_ring* ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+		int free = 0;
+		if (ring != NULL && __atomic_compare_exchange_n(&ring->in_use, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return ring;
+		}
+	}
+
+	int i = __atomic_load_n(&n_rings, __ATOMIC_RELAXED);
+	do {
+		if (i >= TRACE_MAX_THREADS) return NULL;
+	} while (!__atomic_compare_exchange_n(&n_rings, &i, i+1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	struct trace_ring* ring;
+	assert((ring = calloc(1, sizeof *ring)) != NULL);
+	ring->in_use = 1;
+	__atomic_store_n(&rings[i], ring, __ATOMIC_RELEASE);
+	return ring;
+}
+
+void trace_record(const char* name, s64 t0, s64 t1)
+{
+	struct trace_ring* ring = thread_ring;
+	if (ring == NULL) {
+		if (!thread_has_no_ring) {
+			ring = claim_ring();
+			if (ring == NULL) {
+				thread_has_no_ring = 1;
+				__atomic_fetch_add(&n_dropped_threads, 1, __ATOMIC_RELAXED);
+			}
+		}
+		if (ring == NULL) {
+			// only past TRACE_MAX_THREADS live threads
+			__atomic_fetch_add(&n_dropped_spans, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		ring->name = thread_name;
+		pthread_once(&ring_key_once, create_ring_key);
+		pthread_setspecific(ring_key, ring);
+		thread_ring = ring;
+	}
+	struct trace_span* span = &ring->spans[ring->n & (TRACE_RING-1)];
+	span->name = name;
+	span->t0 = t0;
+	span->t1 = t1;
+	ring->n++;
+}
+
+void trace_name_thread(const char* name)
+{
+	thread_name = name;
+	if (thread_ring != NULL) thread_ring->name = name;
+}
+
+// spans of threads that are recording while this runs may come out torn;
+// dump between frames
+int trace_dump(const char* path)
+{
+	FILE* f = fopen(path, "w");
+	if (f == NULL) return -1;
+
+	const int n = MIN(__atomic_load_n(&n_rings, __ATOMIC_ACQUIRE), TRACE_MAX_THREADS);
+
+	// timestamps relative to the earliest span
+	s64 origin = 0;
+	for (int i = 0; i < n; i++) {
+		const struct trace_ring* ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+		if (ring == NULL) continue;
+		const int n_spans = MIN(ring->n, TRACE_RING);
+		for (int j = 0; j < n_spans; j++) {
+			const s64 t0 = ring->spans[(ring->n - n_spans + j) & (TRACE_RING-1)].t0;
+			if (origin == 0 || t0 < origin) origin = t0;
+		}
+	}
+
+	int n_written = 0;
+	const char* sep = "";
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (int i = 0; i < n; i++) {
+		const struct trace_ring* ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+		if (ring == NULL) continue;
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			sep, i, ring->name != NULL ? ring->name : "thread");
+		sep = ",\n";
+		const int n_spans = MIN(ring->n, TRACE_RING);
+		for (int j = 0; j < n_spans; j++) {
+			const struct trace_span* s = &ring->spans[(ring->n - n_spans + j) & (TRACE_RING-1)];
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				s->name, i, (double)(s->t0 - origin) * 1e-3, (double)(s->t1 - s->t0) * 1e-3);
+			n_written++;
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if (fclose(f) != 0) return -1;
+
+	const int n_dropped = __atomic_load_n(&n_dropped_threads, __ATOMIC_RELAXED);
+	if (n_dropped > 0) {
+		fprintf(stderr, "trace: %d threads found no free ring (of %d); %lld spans dropped\n",
+			n_dropped, TRACE_MAX_THREADS, (long long)__atomic_load_n(&n_dropped_spans, __ATOMIC_RELAXED));
+	}
+	return n_written;
+}
@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+
+#include "common.h"
+
+/*
+
+TRACE SPANS
+
+Spans are recorded into a ring of TRACE_RING spans per thread, claimed the
+first time the thread records one, and written out by trace_dump() as
+Chrome trace-event JSON (load it in chrome://tracing or ui.perfetto.dev),
+with a track per ring. A thread's ring is given back when it exits, so the
+workers of each new vxl pool continue the tracks of the last one. Threads
+beyond TRACE_MAX_THREADS live ones record nothing; trace_dump() says how
+much was dropped. A span is timed like this:
+
+  const s64 t0 = trace_begin();
+  ...
+  trace_end("name", t0);
+
+While tracing is disabled (the default) trace_begin() returns 0 and
+trace_end() ignores it, so a span costs a load and two branches. The name
+must be a string literal or otherwise outlive the trace.
+
+*/
+
+#define TRACE_RING (1<<16)
+#define TRACE_MAX_THREADS (64)
+
+extern int trace_enabled;
+
+void trace_enable(int enable);
+
+// CLOCK_MONOTONIC in nanoseconds; the clock everything is timed with
+s64 trace_now_ns();
+
+void trace_record(const char* name, s64 t0, s64 t1);
+
+// names the calling thread's track
+void trace_name_thread(const char* name);
+
+// writes the spans in the rings to path, and to stderr how many threads and
+// spans found no ring; returns the number of spans written, or -1 if path
+// can't be written
+int trace_dump(const char* path);
+
+static inline s64 trace_begin(void)
+{
+	return trace_enabled ? trace_now_ns() : 0;
+}
+
+static inline void trace_end(const char* name, s64 t0)
+{
+	if (t0 != 0) trace_record(name, t0, trace_now_ns());
+}
+
+#define TRACE_H
+#endif
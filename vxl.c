@@ -1,9 +1,19 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "vxl.h"
+#include "trace.h"
+#include "perf.h"
 #include "common.h"
 
 /*
@@ -61,423 +71,2398 @@ static inline int count_chunk_diagonals()
 	return diagonal_count(CHUNK_LENGTH, CHUNK_LENGTH, CHUNK_LENGTH);
 }
 
-static union ivec3* mk_ivec3_queue(int* pcap, int cap)
+static void dirty_init(struct vxl_dirty* d, int n_chunks)
 {
-	*pcap = cap;
-	union ivec3* r = malloc(cap * sizeof(*r));
-	assert(r != NULL);
-	return r;
+	memset(d, 0, sizeof *d);
+	assert((d->bits = calloc(n_chunks * CHUNK_WORDS, sizeof *d->bits)) != NULL);
+	assert((d->chunk_flags = calloc(n_chunks, sizeof *d->chunk_flags)) != NULL);
+	assert((d->chunks = malloc(n_chunks * sizeof *d->chunks)) != NULL);
 }
 
-void vxl_init(struct vxl* vxl, int dim_x, int dim_y, int dim_z)
+static void dirty_free(struct vxl_dirty* d)
 {
-	memset(vxl, 0, sizeof* vxl);
+	free(d->bits);
+	free(d->chunk_flags);
+	free(d->chunks);
+}
 
-	// XXX do I want this potceil stuff? it effectively "expands" the
-	// arena, opening it up for celluar automata and such?
-	dim_x = potceil(dim_x, CHUNK_LENGTH_LOG2);
-	dim_y = potceil(dim_y, CHUNK_LENGTH_LOG2);
-	dim_z = potceil(dim_z, CHUNK_LENGTH_LOG2);
+static inline void dirty_mark(struct vxl_dirty* d, int idx)
+{
+	u64* word = &d->bits[idx >> 6];
+	u64 mask = (u64)1 << (idx & 63);
+	if (*word & mask) return;
+	*word |= mask;
+	d->n_voxels++;
+
+	int chunk_index = idx >> CHUNK_VOLUME_LOG2;
+	if (d->chunk_flags[chunk_index]) return;
+	d->chunk_flags[chunk_index] = 1;
+	d->chunks[d->n_chunks++] = chunk_index;
+}
 
-	vxl->dim_x = dim_x;
-	vxl->dim_y = dim_y;
-	vxl->dim_z = dim_z;
+static int intcmp(const void* va, const void* vb)
+{
+	int a = *(const int*)va;
+	int b = *(const int*)vb;
+	return (a > b) - (a < b);
+}
 
-	int chunk_dim_x = vxl->chunk_dim_x = dim_x >> CHUNK_LENGTH_LOG2;
-	int chunk_dim_y = vxl->chunk_dim_y = dim_y >> CHUNK_LENGTH_LOG2;
-	int chunk_dim_z = vxl->chunk_dim_z = dim_z >> CHUNK_LENGTH_LOG2;
-	vxl->cdxy = chunk_dim_x * chunk_dim_y;
+// sorts the chunk list so that dirty_walk() visits voxels in memory order
+static void dirty_sort(struct vxl_dirty* d)
+{
+	qsort(d->chunks, d->n_chunks, sizeof *d->chunks, intcmp);
+}
 
-	int n_voxels = dim_x * dim_y * dim_z;
+// calls fn() for every voxel in chunks [i0;i1) of the chunk list, and clears
+// them. returns the number of voxels visited. different threads may walk
+// disjoint ranges of the same set concurrently
+static inline int dirty_walk(struct vxl* vxl, struct vxl_dirty* d, void(*fn)(struct vxl*, int, int, int), int i0, int i1)
+{
+	int n = 0;
+	for (int i = i0; i < i1; i++) {
+		int chunk_index = d->chunks[i];
+		d->chunk_flags[chunk_index] = 0;
+
+		int cx, cy, cz;
+		vxl_chunk_xyz(vxl, chunk_index, &cx, &cy, &cz);
+		// guard band chunks are at -1, so multiply; shifting them is undefined
+		cx *= CHUNK_LENGTH;
+		cy *= CHUNK_LENGTH;
+		cz *= CHUNK_LENGTH;
+
+		u64* words = &d->bits[chunk_index * CHUNK_WORDS];
+		for (int j = 0; j < CHUNK_WORDS; j++) {
+			u64 word = words[j];
+			words[j] = 0;
+			while (word) {
+				int local_index = (j << 6) + __builtin_ctzll(word);
+				word &= word - 1;
+				int x, y, z;
+				vxl_local_xyz(vxl, local_index, &x, &y, &z);
+				fn(vxl, cx+x, cy+y, cz+z);
+				n++;
+			}
+		}
+	}
+	return n;
+}
 
-	assert((vxl->data = calloc(n_voxels, sizeof *vxl->data)) != NULL);
-	assert((vxl->shade = calloc(n_voxels, sizeof *vxl->shade)) != NULL);
+// call when all chunks have been walked
+static void dirty_reset(struct vxl_dirty* d)
+{
+	d->n_chunks = 0;
+	d->n_voxels = 0;
+}
 
-	int n_chunks = chunk_dim_x * chunk_dim_y * chunk_dim_z;
+// empties the set without walking it
+static void dirty_clear(struct vxl_dirty* d)
+{
+	for (int i = 0; i < d->n_chunks; i++) {
+		int chunk_index = d->chunks[i];
+		d->chunk_flags[chunk_index] = 0;
+		memset(&d->bits[chunk_index * CHUNK_WORDS], 0, CHUNK_WORDS * sizeof *d->bits);
+	}
+	dirty_reset(d);
+}
 
-	vxl_bounding_rect(&vxl->bitmap_width, &vxl->bitmap_height, dim_x, dim_y, dim_z);
-	assert((vxl->bitmap = calloc(vxl->bitmap_width * vxl->bitmap_height, sizeof *vxl->bitmap)) != NULL);
+// marks all voxels in [x0;x1) × [y0;y1) × [z0;z1), a chunk row at a time
+// in the linear layout. the box must be inside the world or its guard band
+static void dirty_mark_box(struct vxl* vxl, struct vxl_dirty* d, int x0, int y0, int z0, int x1, int y1, int z1)
+{
+	for (int cz = z0 >> CHUNK_LENGTH_LOG2; cz <= (z1-1) >> CHUNK_LENGTH_LOG2; cz++) {
+		const int oz = cz * CHUNK_LENGTH;
+		const int lz0 = MAX(z0 - oz, 0);
+		const int lz1 = MIN(z1 - oz, CHUNK_LENGTH);
+		for (int cy = y0 >> CHUNK_LENGTH_LOG2; cy <= (y1-1) >> CHUNK_LENGTH_LOG2; cy++) {
+			const int oy = cy * CHUNK_LENGTH;
+			const int ly0 = MAX(y0 - oy, 0);
+			const int ly1 = MIN(y1 - oy, CHUNK_LENGTH);
+			for (int cx = x0 >> CHUNK_LENGTH_LOG2; cx <= (x1-1) >> CHUNK_LENGTH_LOG2; cx++) {
+				const int ox = cx * CHUNK_LENGTH;
+				const int lx0 = MAX(x0 - ox, 0);
+				const int lx1 = MIN(x1 - ox, CHUNK_LENGTH);
+
+				const int chunk_index = vxl_chunk_idx(vxl, cx, cy, cz);
+				u64* words = &d->bits[chunk_index * CHUNK_WORDS];
+				int n = 0;
+				#ifdef VXL_MORTON
+				for (int lz = lz0; lz < lz1; lz++) {
+					for (int ly = ly0; ly < ly1; ly++) {
+						for (int lx = lx0; lx < lx1; lx++) {
+							const int local_index = vxl_local_idx(vxl, lx, ly, lz);
+							u64* word = &words[local_index >> 6];
+							const u64 mask = (u64)1 << (local_index & 63);
+							n += !(*word & mask);
+							*word |= mask;
+						}
+					}
+				}
+				#else
+				const u64 row = (((u64)1 << (lx1 - lx0)) - 1) << lx0;
+				for (int lz = lz0; lz < lz1; lz++) {
+					for (int ly = ly0; ly < ly1; ly++) {
+						// rows never straddle words
+						const int local_index = vxl_local_idx(vxl, 0, ly, lz);
+						u64* word = &words[local_index >> 6];
+						const u64 mask = row << (local_index & 63);
+						n += __builtin_popcountll(mask & ~*word);
+						*word |= mask;
+					}
+				}
+				#endif
 
-	#ifdef DEBUG
-	printf("vxl n_voxels: %d\n", n_voxels);
-	printf("vxl n_chunks: %d\n", n_chunks);
-	printf("vxl bitmap: %d × %d\n", vxl->bitmap_width, vxl->bitmap_height);
-	#endif
+				d->n_voxels += n;
+				if (n == 0 || d->chunk_flags[chunk_index]) continue;
+				d->chunk_flags[chunk_index] = 1;
+				d->chunks[d->n_chunks++] = chunk_index;
+			}
+		}
+	}
+}
+
+// true if all voxels of the chunk are in the set
+static inline int dirty_chunk_full(struct vxl_dirty* d, int chunk_index)
+{
+	const u64* words = &d->bits[chunk_index * CHUNK_WORDS];
+	for (int j = 0; j < CHUNK_WORDS; j++) if (~words[j]) return 0;
+	return 1;
+}
+
+/*
+
+WORKER POOL
+
+pool_for() runs fn() over [0;n) in ranges of (at most) grain items, spread
+over the pool's worker threads and the calling thread, and returns the sum
+of what fn() returned. it returns when all ranges are done, so two
+pool_for() calls in a row act like a barrier.
+
+*/
 
-	{
-		const int base_cap = 1<<14;
-		vxl->shade_queue  = mk_ivec3_queue(&vxl->shade_queue_cap,  4*base_cap);
-		vxl->render_queue = mk_ivec3_queue(&vxl->render_queue_cap, base_cap);
+typedef int (*pool_fn)(struct vxl* vxl, void* usr, int i0, int i1);
+
+struct vxl_pool {
+	int n_threads;
+	pthread_t* threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	int generation;
+	int exiting;
+
+	// current pool_for() call
+	struct vxl* vxl;
+	pool_fn fn;
+	void* usr;
+	int n;
+	int grain;
+	int next;
+	int n_busy;
+	int sum;
+};
+
+// called with mutex held
+static void pool_work(struct vxl_pool* pool)
+{
+	while (pool->next < pool->n) {
+		int i0 = pool->next;
+		int i1 = MIN(i0 + pool->grain, pool->n);
+		pool->next = i1;
+		pthread_mutex_unlock(&pool->mutex);
+		int r = pool->fn(pool->vxl, pool->usr, i0, i1);
+		pthread_mutex_lock(&pool->mutex);
+		pool->sum += r;
 	}
+}
 
-	vxl_set_rotation(vxl, 0);
+static void* pool_thread(void* usr)
+{
+	struct vxl_pool* pool = usr;
+	int generation = 0;
+	trace_name_thread("vxl worker");
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->exiting && pool->generation == generation) {
+			pthread_cond_wait(&pool->start_cond, &pool->mutex);
+		}
+		if (pool->exiting) break;
+		generation = pool->generation;
+		pool->n_busy++;
+		const s64 trace_t0 = trace_begin();
+		pool_work(pool);
+		trace_end("pool work", trace_t0);
+		if (--pool->n_busy == 0) pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
 }
 
-#define XA_VXYZ(vx,vy,vz) XA(((vx) == 1 || (vx) == -1) && ((vy) == 1 || (vy) == -1) && ((vz) == 1 || (vz) == -1))
+static struct vxl_pool* pool_new(int n_threads)
+{
+	struct vxl_pool* pool = calloc(1, sizeof *pool);
+	assert(pool != NULL);
+	pool->n_threads = n_threads;
+	assert((pool->threads = calloc(n_threads, sizeof *pool->threads)) != NULL);
+	assert(pthread_mutex_init(&pool->mutex, NULL) == 0);
+	assert(pthread_cond_init(&pool->start_cond, NULL) == 0);
+	assert(pthread_cond_init(&pool->done_cond, NULL) == 0);
+	for (int i = 0; i < n_threads; i++) {
+		assert(pthread_create(&pool->threads[i], NULL, pool_thread, pool) == 0);
+	}
+	return pool;
+}
 
-// diagonal distance to edge of AABB with dimensions [dx,dy,dz] along vector
-// [vx,vy,vz] from position [x,y,z]. (not eucledean distance; 3 steps along
-// [vx,vy,vz] means 3 is returned)
-static inline int diagonal_dist(int vx, int vy, int vz, int dx, int dy, int dz, int x, int y, int z)
+static void pool_free(struct vxl_pool* pool)
 {
-	XA_VXYZ(vx, vy, vz);
-	int nx = (vx<0) ? (x) : (dx-x-1);
-	int ny = (vy<0) ? (y) : (dy-y-1);
-	int nz = (vz<0) ? (z) : (dz-z-1);
-	return MIN(nx, MIN(ny, nz));
+	if (pool == NULL) return;
+	pthread_mutex_lock(&pool->mutex);
+	pool->exiting = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (int i = 0; i < pool->n_threads; i++) pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
 }
 
-static inline void as_diagonal(int vx, int vy, int vz, int dx, int dy, int dz, int* x, int* y, int* z)
+static int pool_for(struct vxl* vxl, pool_fn fn, void* usr, int n, int grain)
 {
-	XA_VXYZ(vx, vy, vz);
-	int n = diagonal_dist(vx, vy, vz, dx, dy, dz, *x, *y, *z);
-	*x += vx*n;
-	*y += vy*n;
-	*z += vz*n;
+	struct vxl_pool* pool = vxl->pool;
+	if (pool == NULL || n <= grain) return fn(vxl, usr, 0, n);
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->vxl = vxl;
+	pool->fn = fn;
+	pool->usr = usr;
+	pool->n = n;
+	pool->grain = grain;
+	pool->next = 0;
+	pool->sum = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start_cond);
+	pool_work(pool);
+	while (pool->n_busy > 0) pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	int sum = pool->sum;
+	pthread_mutex_unlock(&pool->mutex);
+	return sum;
 }
 
-static int ivec3cmp(const void* va, const void* vb)
+void vxl_set_threads(struct vxl* vxl, int n_threads)
 {
-	// XXX might be better to do a "proper compare"? because memcmp() is
-	// "big-endian" by necessity, so the ordering is weird on little-endian
-	// archs (for correctness, only consistent ordering is required,
-	// including that memcmp() must return zero for equal ivec3's)
-	return memcmp(va, vb, sizeof(union ivec3));
+	if (n_threads <= 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		n_threads = n > 0 ? n : 1;
+	}
+	pool_free(vxl->pool);
+	vxl->pool = n_threads > 1 ? pool_new(n_threads - 1) : NULL;
+	vxl->n_threads = n_threads;
 }
 
-#define SHADE_X  (1)
-#define SHADE_Y  (2)
-#define SHADE_Z  (3)
-#define SHADE_XY (4)
+/*
+
+RECORDING
+
+With vxl->record set (see vxl_record()) the API calls that change what
+vxl_flush() has to do are appended to it in the format described in vxl.h.
+Internal calls, like the flushes vxl_set_rotation() forces, aren't
+recorded; replaying the call that made them makes them again.
+
+*/
+
+static inline u8* put_s32(u8* p, s32 v)
+{
+	const u32 u = v;
+	p[0] = u;
+	p[1] = u >> 8;
+	p[2] = u >> 16;
+	p[3] = u >> 24;
+	return p + 4;
+}
 
-static inline void update_shade(struct vxl* vxl, int x, int y, int z)
+static void record_op(struct vxl* vxl, int op, const s32* args, int n_args, const u8* bytes, int n_bytes)
 {
-	int vx = vxl->rotation_vx;
-	int vy = vxl->rotation_vy;
-	const int vz = -1;
+	u8 buf[1 + 8*4];
+	assert(n_args <= 8);
+	u8* p = buf;
+	*p++ = op;
+	for (int i = 0; i < n_args; i++) p = put_s32(p, args[i]);
+	fwrite(buf, 1, p - buf, vxl->record);
+	if (n_bytes > 0) fwrite(bytes, 1, n_bytes, vxl->record);
+}
 
-	XA_VXYZ(vx,vy,vz);
+// puts are most of a recording, so they get an op of their own
+static void record_put(struct vxl* vxl, int x, int y, int z, u8 v)
+{
+	const u8 buf[8] = { VXL_OP_PUT, x, x >> 8, y, y >> 8, z, z >> 8, v };
+	fwrite(buf, 1, sizeof buf, vxl->record);
+}
 
-	int nx = vxl->data[vxl_idx(vxl, x-vx, y,    z   )] == 0;
-	int ny = vxl->data[vxl_idx(vxl, x,    y-vy, z   )] == 0;
-	int nz = vxl->data[vxl_idx(vxl, x,    y,    z-vz)] == 0;
+static void record_palette(struct vxl* vxl, const u32* palette)
+{
+	u8 bytes[256*4];
+	for (int i = 0; i < 256; i++) put_s32(&bytes[i*4], palette[i]);
+	record_op(vxl, VXL_OP_PALETTE, NULL, 0, bytes, sizeof bytes);
+}
 
-	u8 set_shade;
-	if (nz) {
-		set_shade = SHADE_Z;
-	} else if (nx && !ny) {
-		set_shade = SHADE_X;
-	} else if (ny && !nx) {
-		set_shade = SHADE_Y;
-	} else if (nx && ny) {
-		set_shade = SHADE_XY;
-	} else {
-		set_shade = SHADE_X; // XXX good default?
+/*
+
+PALETTE
+
+vxl->colors has the two colours of a fat pixel (left/right half) for every
+material and shade, so rendering a voxel is a table lookup. A shade scales
+the material's RGB by a light level per half; alpha is kept. Shade 0 (air)
+is transparent black. A voxel's shade isn't stored; render_diagonal() looks
+it up from the voxel's face mask (see FACES) in vxl->face_shade.
+
+render_diagonal() also records the material and shade it drew in
+vxl->hits, so vxl_set_palette() doesn't need to find hits again: the flush
+after it repaints the fat pixels whose material changed from vxl->hits.
+
+*/
+
+#define N_SHADES (5)
+
+static const u8 shade_levels[N_SHADES][2] = {
+	{0x00, 0x00},
+	{0x55, 0x55}, // SHADE_X
+	{0x77, 0x77}, // SHADE_Y
+	{0xaa, 0xaa}, // SHADE_Z
+	{0x77, 0x55}, // SHADE_XY
+};
+
+static inline u32 scale_rgb(u32 rgba, int level)
+{
+	u32 out = rgba & 0xff000000;
+	for (int shift = 0; shift < 24; shift += 8) {
+		u32 c = (rgba >> shift) & 0xff;
+		out |= ((c * level) / 0xff) << shift;
 	}
+	return out;
+}
 
-	vxl->shade[vxl_idx(vxl, x, y, z)] = set_shade;
+static inline const u32* get_colors(struct vxl* vxl, u8 voxel, u8 shade)
+{
+	return &vxl->colors[(voxel * N_SHADES + shade) * 2];
 }
 
-static inline void get_voxel_rgba(u32* rgba0, u32* rgba1, u8 voxel, u8 shade)
+static void update_colors(struct vxl* vxl, int voxel)
 {
-	if (shade == SHADE_X) {
-		*rgba0 = 0xff555555;
-		*rgba1 = 0xff555555;
-	} else if (shade == SHADE_Y) {
-		*rgba0 = 0xff777777;
-		*rgba1 = 0xff777777;
-	} else if (shade == SHADE_Z) {
-		*rgba0 = 0xffaaaaaa;
-		*rgba1 = 0xffaaaaaa;
-	} else if (shade == SHADE_XY) {
-		*rgba0 = 0xff777777;
-		*rgba1 = 0xff555555;
+	u32* colors = &vxl->colors[voxel * N_SHADES * 2];
+	for (int shade = 0; shade < N_SHADES; shade++) {
+		for (int half = 0; half < 2; half++) {
+			colors[shade*2 + half] = shade == 0 ? 0 : scale_rgb(vxl->palette[voxel], shade_levels[shade][half]);
+		}
 	}
 }
 
+static inline int hit_material(u16 hit)
+{
+	return hit >> 8;
+}
 
-static inline void render_diagonal(struct vxl* vxl, int x, int y, int z)
+static inline u16 make_hit(u8 voxel, u8 shade)
 {
-	const int vx = vxl->rotation_vx;
-	const int vy = vxl->rotation_vy;
-	const int vz = -1;
+	return (voxel << 8) | shade;
+}
 
-	const int dx = vxl->dim_x;
-	const int dy = vxl->dim_y;
-	const int dz = vxl->dim_z;
+/*
 
-	u32 rgba0 = 0;
-	u32 rgba1 = 0;
+FACES
 
-	int dist = diagonal_dist(
-		vx, vy, vz,
-		dx, dy, dz,
-		x, y, z);
+vxl->chunk_faces has a mask per voxel telling which of its six faces are
+exposed. It doesn't depend on the rotation, so rotating only needs a
+re-render. vxl_put() queues a voxel and its face neighbours for
+update_faces() when it turns solid or air; full updates run faces_chunk() on
+every chunk. Which shade a mask gives depends on which faces point towards
+the camera, so that's a per-rotation table, vxl->face_shade.
 
-	for (int i = 0; i <= dist; i++) {
-		int idx = vxl_idx(vxl, x, y, z);
-		u8 v = vxl->data[idx];
-		if (v > 0) {
-			u8 s = vxl->shade[idx];
-			get_voxel_rgba(&rgba0, &rgba1, v, s);
-			break;
-		}
+*/
+
+#define SHADE_X  (1)
+#define SHADE_Y  (2)
+#define SHADE_Z  (3)
+#define SHADE_XY (4)
 
-		x += vx;
-		y += vy;
-		z += vz;
+// face exposure bits; a face is exposed if the neighbour on that side is air
+// or outside the world
+#define FACE_XN (1<<0)
+#define FACE_XP (1<<1)
+#define FACE_YN (1<<2)
+#define FACE_YP (1<<3)
+#define FACE_ZN (1<<4)
+#define FACE_ZP (1<<5)
+#define N_FACE_MASKS (1<<6)
+
+// fills vxl->face_shade, the shade of a solid voxel for each face mask as
+// seen from the current rotation: the faces towards the camera are the ones
+// facing -rotation_vx, -rotation_vy and Z+
+static void update_face_shade(struct vxl* vxl)
+{
+	const int fx = vxl->rotation_vx < 0 ? FACE_XP : FACE_XN;
+	const int fy = vxl->rotation_vy < 0 ? FACE_YP : FACE_YN;
+	for (int faces = 0; faces < N_FACE_MASKS; faces++) {
+		const int nx = (faces & fx) != 0;
+		const int ny = (faces & fy) != 0;
+		const int nz = (faces & FACE_ZP) != 0;
+		u8 shade;
+		if (nz) {
+			shade = SHADE_Z;
+		} else if (nx && !ny) {
+			shade = SHADE_X;
+		} else if (ny && !nx) {
+			shade = SHADE_Y;
+		} else if (nx && ny) {
+			shade = SHADE_XY;
+		} else {
+			shade = SHADE_X; // XXX good default?
+		}
+		vxl->face_shade[faces] = shade;
 	}
+}
 
-	// projection
+/*
 
-	int xq = x;
-	int yq = y;
-	int zq = z;
+CHUNK STORAGE
 
-	int dxq = dx;
-	int dyq = dy;
-	int dzq = dz;
+Most chunks in a typical world are all air or all bedrock, so a chunk only
+owns a CHUNK_VOLUME block in vxl->chunk_data/vxl->chunk_faces while its
+contents are mixed; otherwise it points into vxl->uniform, which has one
+block for each byte value. Shared blocks are never written: own_block()
+gives the chunk a copy first, and compact_block() hands it back once the
+chunk is uniform again. vxl_put() checks that when a chunk's solid count
+reaches 0 or CHUNK_VOLUME, and full updates check every chunk.
 
-	for (int i = 0; i < vxl->rotation; i++) {
-		// XXX TODO can't I transform the *q variables to do the right
-		// thing like this?
-	}
+Air voxels have no exposed faces, so air chunks share block 0 for faces too,
+and so do chunks buried in solid chunks.
 
-	const int sx = 2*(dxq-1+xq-yq);
-	const int sy = (xq+yq) + 2*(dzq-1-zq);
+The chunk tables have a guard band of one air chunk around the world. Edits
+are clipped to the world, so guard chunks keep pointing at uniform block 0
+and stay empty, and face neighbours of world voxels and chunks can be read
+without bounds checks. Loops over all chunks of the world go through
+world_chunk() to skip the guard band.
 
-	XA(sx >= 0);
-	XA(sy >= 0);
-	XA(sx < vxl->bitmap_width);
-	XA(sy < vxl->bitmap_height);
+*/
 
-	// draw "fat pixel"
-	const int w = vxl->bitmap_width;
-	u32* pixel = &vxl->bitmap[sx + sy*w];
-	pixel[0]   = rgba0;
-	pixel[1]   = rgba1;
-	pixel[w]   = rgba0;
-	pixel[w+1] = rgba1;
+static inline u8* uniform_block(struct vxl* vxl, u8 v)
+{
+	return &vxl->uniform[v << CHUNK_VOLUME_LOG2];
 }
 
-static void clear_bitmap(struct vxl* vxl)
+static inline int is_uniform_block(struct vxl* vxl, const u8* p)
 {
-	memset(vxl->bitmap, 0, vxl->bitmap_width * vxl->bitmap_height * sizeof(*vxl->bitmap));
+	return (uintptr_t)p - (uintptr_t)vxl->uniform < ((uintptr_t)256 << CHUNK_VOLUME_LOG2);
 }
 
-void vxl_flush(struct vxl* vxl)
+// true if all bytes in the block are the same
+static inline int block_is_uniform(const u8* p)
 {
-	if (vxl->full_update) {
-		clear_bitmap(vxl);
+	return memcmp(p, p+1, CHUNK_VOLUME-1) == 0;
+}
 
-		const int dx = vxl->dim_x;
-		const int dy = vxl->dim_y;
-		const int dz = vxl->dim_z;
+// returns the block table[chunk_index], after making it the chunk's own if it
+// was shared
+static inline u8* own_block(struct vxl* vxl, u8** table, int chunk_index)
+{
+	u8* p = table[chunk_index];
+	if (!is_uniform_block(vxl, p)) return p;
+	u8* q = malloc(CHUNK_VOLUME);
+	assert(q != NULL);
+	memcpy(q, p, CHUNK_VOLUME);
+	return table[chunk_index] = q;
+}
 
-		const int vx = vxl->rotation_vx;
-		const int vy = vxl->rotation_vy;
+static inline void release_block(struct vxl* vxl, u8** table, int chunk_index, u8 v)
+{
+	u8* p = table[chunk_index];
+	if (!is_uniform_block(vxl, p)) free(p);
+	table[chunk_index] = uniform_block(vxl, v);
+}
 
-		// full per-voxel shade update
-		{
+static inline void compact_block(struct vxl* vxl, u8** table, int chunk_index)
+{
+	u8* p = table[chunk_index];
+	if (!is_uniform_block(vxl, p) && block_is_uniform(p)) release_block(vxl, table, chunk_index, p[0]);
+}
 
-			const int x0 = vx > 0 ? 1    : 0;
-			const int x1 = vx > 0 ? (dx) : (dx-1);
-			const int y0 = vy > 0 ? 1    : 0;
-			const int y1 = vy > 0 ? (dy) : (dy-1);
-			const int z0 = 0;
-			const int z1 = dz-1;
+// copies block to table[chunk_index], or shares a uniform block if it can
+static inline void store_block(struct vxl* vxl, u8** table, int chunk_index, const u8* block)
+{
+	if (block_is_uniform(block)) {
+		release_block(vxl, table, chunk_index, block[0]);
+		return;
+	}
+	u8* p = table[chunk_index];
+	if (is_uniform_block(vxl, p)) {
+		assert((p = malloc(CHUNK_VOLUME)) != NULL);
+		table[chunk_index] = p;
+	}
+	memcpy(p, block, CHUNK_VOLUME);
+}
 
-			for (int z = z0; z < z1; z++) {
-				for (int y = y0; y < y1; y++) {
-					for (int x = x0; x < x1; x++) {
-						update_shade(vxl, x, y, z);
-					}
-				}
-			}
-		}
+static inline int count_world_chunks(struct vxl* vxl)
+{
+	return vxl->chunk_dim_x * vxl->chunk_dim_y * vxl->chunk_dim_z;
+}
 
-		// render all diagonals
-		{
-			// top
-			for (int v = 0; v < dy; v++) {
-				for (int u = 0; u < dx; u++) {
-					render_diagonal(vxl, u, v, dz-1);
-				}
-			}
+// chunk index of world chunk i in [0;count_world_chunks()), in memory order
+static inline int world_chunk(struct vxl* vxl, int i)
+{
+	const int cx = i % vxl->chunk_dim_x;
+	i /= vxl->chunk_dim_x;
+	const int cy = i % vxl->chunk_dim_y;
+	const int cz = i / vxl->chunk_dim_y;
+	return vxl_chunk_idx(vxl, cx, cy, cz);
+}
 
-			// rotation 0 has X+ and Y+ facing the camera, i.e. "d"
-			// through "g" through "4" are visible.
-			//   1234-
-			//   5678-
-			//   9abc-
-			//   defg-
-			//   ||||
-			//
-			// rotation 1 then has Y- and X+ facing the camera
-			//   d951-
-			//   ea62-
-			//   fb73-
-			//   gc84-
-			//   ||||
-
-			// sides
-			int xfront = vx < 0 ? dx-1 : 0;
-			int yfront = vy < 0 ? dy-1 : 0;
-			for (int v = 0; v < (dz-1); v++) {
-				// XXX FIXME there's a bit of overdraw; a
-				// "shared column" between the two loops
-				for (int u = 0; u < dx; u++) {
-					render_diagonal(vxl, u, yfront, v);
-				}
+// number of blocks owned by chunks, i.e. not shared
+static inline int count_blocks(struct vxl* vxl, u8** table)
+{
+	int n = 0;
+	for (int i = 0; i < vxl->n_chunks; i++) n += !is_uniform_block(vxl, table[i]);
+	return n;
+}
 
-				for (int u = 0; u < dy; u++) {
-					render_diagonal(vxl, xfront, u, v);
-				}
-			}
-		}
+/*
 
-		vxl->full_update = 0;
+VIEWS
 
-		#ifdef DEBUG
-		printf("vxl_flush: FULL\n");
-		#endif
-	} else {
-		int n_shaded = 0;
-		int shade_queue_len = vxl->shade_queue_len;
-		{
-			qsort(vxl->shade_queue, shade_queue_len, sizeof *vxl->shade_queue, ivec3cmp);
-			union ivec3* p = vxl->shade_queue;
-			for (int i = 0; i < shade_queue_len; i++, p++) {
-				if (i > 0 && ivec3cmp(p, p-1) == 0) continue; // skip dupes
-				update_shade(vxl, p->x, p->y, p->z);
-				n_shaded++;
-			}
-			vxl->shade_queue_len = 0;
-		}
-
-		int n_rendered = 0;
-		int render_queue_len = vxl->render_queue_len;
-		{
-			qsort(vxl->render_queue, render_queue_len, sizeof *vxl->render_queue, ivec3cmp);
-			union ivec3* p = vxl->render_queue;
-			for (int i = 0; i < render_queue_len; i++, p++) {
-				if (i > 0 && ivec3cmp(p, p-1) == 0) continue; // skip dupes
-				render_diagonal(vxl, p->x, p->y, p->z);
-				n_rendered++;
-			}
-			vxl->render_queue_len = 0;
-		}
+Everything that depends on the rotation (occupancy, bitmap, hits, depths)
+is a view. The shown view lives in struct vxl where the render code expects
+it; with VXL_CACHE_ROTATIONS the other three are parked in vxl->views and
+swapped in by vxl_set_rotation(). A hidden view isn't rendered while hidden;
+vxl_put() only records the voxel in its "changed" set, and showing the view
+marks those voxels like vxl_put() would have, so only that work is done
+then. Puts aren't recorded in "full update" mode, so they make all hidden
+views stale instead; a stale view gets a full update when shown.
 
-		#ifdef DEBUG
-		printf("vxl_flush: shaded %d/%d; rendered %d/%d\n", n_shaded, shade_queue_len, n_rendered, render_queue_len);
-		#endif
+*/
+
+static inline void rotation_vector(int rotation, int* vx, int* vy)
+{
+	*vx = -1;
+	*vy = -1;
+	for (int i = 0; i < rotation; i++) {
+		int tmp = *vx;
+		*vx = *vy;
+		*vy = -tmp;
 	}
+}
 
-	assert(vxl->full_update == 0);
-	assert(vxl->shade_queue_len == 0);
-	assert(vxl->render_queue_len == 0);
+static void view_init(struct vxl* vxl, struct vxl_view* view, int rotation)
+{
+	memset(view, 0, sizeof *view);
+	view->rotation = rotation;
+	rotation_vector(rotation, &view->rotation_vx, &view->rotation_vy);
+
+	assert((view->occupancy = calloc(vxl->occupancy_size, sizeof *view->occupancy)) != NULL);
+	assert((view->bitmap = calloc(vxl->bitmap_width * vxl->bitmap_height, sizeof *view->bitmap)) != NULL);
+	assert((view->hits = calloc(vxl->bitmap_height * vxl->occupancy_row, sizeof *view->hits)) != NULL);
+	assert((view->depths = malloc(vxl->bitmap_height * vxl->occupancy_row * sizeof *view->depths)) != NULL);
+	memset(view->depths, 0xff, vxl->bitmap_height * vxl->occupancy_row * sizeof *view->depths);
+	if (vxl->flags & VXL_CACHE_ROTATIONS) dirty_init(&view->changed, vxl->n_chunks);
+
+	// nothing is rendered yet
+	view->stale = 1;
 }
 
-int vxl_put(struct vxl* vxl, int x, int y, int z, u8 v)
+static void view_free(struct vxl* vxl, struct vxl_view* view)
 {
-	if (!vxl_inside(vxl, x, y, z)) return 0;
-	int idx = vxl_idx(vxl, x, y, z);
+	free(view->occupancy);
+	free(view->bitmap);
+	free(view->hits);
+	free(view->depths);
+	dirty_free(&view->changed);
+}
 
-	u8 p = vxl->data[idx];
-	vxl->data[idx] = v;
+static void save_view(struct vxl* vxl, struct vxl_view* view)
+{
+	view->rotation = vxl->rotation;
+	view->rotation_vx = vxl->rotation_vx;
+	view->rotation_vy = vxl->rotation_vy;
+	view->occupancy = vxl->occupancy;
+	view->bitmap = vxl->bitmap;
+	view->hits = vxl->hits;
+	view->depths = vxl->depths;
+	memcpy(view->palette_dirty, vxl->palette_dirty, sizeof view->palette_dirty);
+	view->palette_changed = vxl->palette_changed;
+}
 
-	if (vxl->full_update || p == v) {
-		// if in "full update" mode, or if the put is a no-op, bail
-		// early because the rest deals with shade/render queues
-		return 0;
-	}
+static void load_view(struct vxl* vxl, struct vxl_view* view)
+{
+	vxl->rotation = view->rotation;
+	vxl->rotation_vx = view->rotation_vx;
+	vxl->rotation_vy = view->rotation_vy;
+	vxl->occupancy = view->occupancy;
+	vxl->bitmap = view->bitmap;
+	vxl->hits = view->hits;
+	vxl->depths = view->depths;
+	memcpy(vxl->palette_dirty, view->palette_dirty, sizeof vxl->palette_dirty);
+	vxl->palette_changed = view->palette_changed;
+}
 
-	//const int shade_max_req = 4;
-	const int shade_max_req = 3*3*3; // XXX
-	const int render_req = 1;
+// the vxl->views slot the shown view belongs in
+static inline int shown_view_index(struct vxl* vxl)
+{
+	return (vxl->flags & VXL_CACHE_ROTATIONS) ? vxl->rotation : 0;
+}
 
-	int must_flush =
-		   (vxl->shade_queue_len  + shade_max_req > vxl->shade_queue_cap)
-		|| (vxl->render_queue_len + render_req    > vxl->render_queue_cap);
+void vxl_init(struct vxl* vxl, int dim_x, int dim_y, int dim_z, int flags)
+{
+	memset(vxl, 0, sizeof* vxl);
 
-	int ret = 0;
-	if (must_flush) {
-		ret = 1;
-		vxl_flush(vxl);
+	vxl->flags = flags;
 
-		#ifdef DEBUG
-		// asserting that flushing "did its thing" so that we have the required
-		// capacity
-		must_flush =
-			   (vxl->shade_queue_len  + shade_max_req > vxl->shade_queue_cap)
-			|| (vxl->render_queue_len + render_req    > vxl->render_queue_cap);
-		assert(!must_flush);
-		#endif
-	}
+	// XXX do I want this potceil stuff? it effectively "expands" the
+	// arena, opening it up for celluar automata and such?
+	dim_x = potceil(dim_x, CHUNK_LENGTH_LOG2);
+	dim_y = potceil(dim_y, CHUNK_LENGTH_LOG2);
+	dim_z = potceil(dim_z, CHUNK_LENGTH_LOG2);
+
+	vxl->dim_x = dim_x;
+	vxl->dim_y = dim_y;
+	vxl->dim_z = dim_z;
 
-	int do_update_shade = (p == 0) != (v == 0);
+	int chunk_dim_x = vxl->chunk_dim_x = dim_x >> CHUNK_LENGTH_LOG2;
+	int chunk_dim_y = vxl->chunk_dim_y = dim_y >> CHUNK_LENGTH_LOG2;
+	int chunk_dim_z = vxl->chunk_dim_z = dim_z >> CHUNK_LENGTH_LOG2;
 
-	union ivec3 ref = (union ivec3){ .x=x, .y=y, .z=z };
+	// guard chunks are never written, so they stay uniform air
+	vxl->chunk_stride_y = chunk_dim_x + 2;
+	vxl->chunk_stride_z = vxl->chunk_stride_y * (chunk_dim_y + 2);
+	vxl->chunk_origin = 1 + vxl->chunk_stride_y + vxl->chunk_stride_z;
+	int n_chunks = vxl->n_chunks = vxl->chunk_stride_z * (chunk_dim_z + 2);
+
+	assert((vxl->uniform = malloc(256 << CHUNK_VOLUME_LOG2)) != NULL);
+	for (int v = 0; v < 256; v++) memset(uniform_block(vxl, v), v, CHUNK_VOLUME);
+	assert((vxl->chunk_data = calloc(n_chunks, sizeof *vxl->chunk_data)) != NULL);
+	assert((vxl->chunk_faces = calloc(n_chunks, sizeof *vxl->chunk_faces)) != NULL);
+	for (int i = 0; i < n_chunks; i++) {
+		vxl->chunk_data[i] = uniform_block(vxl, 0);
+		vxl->chunk_faces[i] = uniform_block(vxl, 0);
+	}
+	assert((vxl->chunk_solid = calloc(n_chunks, sizeof *vxl->chunk_solid)) != NULL);
 
-	if (do_update_shade) {
-		#if 0
-		// push self
-		{
-			union ivec3* s = &vxl->shade_queue[vxl->shade_queue_len++];
-			*s = ref;
-		}
+	vxl_bounding_rect(&vxl->bitmap_width, &vxl->bitmap_height, dim_x, dim_y, dim_z);
 
-		// push X-side
-		int vx = vxl->rotation_vx;
-		if ((vx < 0 && x > 0) || (vx > 0 && x < (vxl->dim_x-1))) {
-			union ivec3* s = &vxl->shade_queue[vxl->shade_queue_len++];
-			*s = ref;
-			s->x = x + vx;
-		}
+	vxl->occupancy_row = (dim_x + dim_y) >> 1;
+	vxl->occupancy_words = (MIN(dim_x, MIN(dim_y, dim_z)) + 63) >> 6;
+	vxl->occupancy_size = vxl->bitmap_height * vxl->occupancy_row * vxl->occupancy_words;
+
+	// the bitmap size doesn't depend on the rotation, so views can
+	// share bitmap_width/bitmap_height
+	vxl->n_views = (flags & VXL_CACHE_ROTATIONS) ? 4 : 1;
+	for (int i = 0; i < vxl->n_views; i++) view_init(vxl, &vxl->views[i], i);
+	load_view(vxl, &vxl->views[0]);
+	update_face_shade(vxl);
+	// an empty world is drawn correctly by an empty bitmap
+	vxl->views[0].stale = 0;
+
+	assert((vxl->colors = calloc(256 * N_SHADES * 2, sizeof *vxl->colors)) != NULL);
+	for (int i = 0; i < 256; i++) {
+		vxl->palette[i] = 0xffffffff;
+		update_colors(vxl, i);
+	}
 
-		// push Y-side
-		int vy = vxl->rotation_vy;
-		if ((vy < 0 && y > 0) || (vy > 0 && y < (vxl->dim_y-1))) {
-			union ivec3* s = &vxl->shade_queue[vxl->shade_queue_len++];
-			*s = ref;
-			s->y = y + vy;
-		}
+	dirty_init(&vxl->shade_dirty, n_chunks);
+	dirty_init(&vxl->render_dirty, n_chunks);
 
-		// push Z-side (top)
-		if (z > 0) {
-			union ivec3* s = &vxl->shade_queue[vxl->shade_queue_len++];
-			*s = ref;
-			s->z = z - 1;
-		}
-		#endif
+	#ifdef DEBUG
+	printf("vxl n_voxels: %d\n", dim_x * dim_y * dim_z);
+	printf("vxl n_chunks: %d (%d with guard band)\n", count_world_chunks(vxl), n_chunks);
+	printf("vxl bitmap: %d × %d\n", vxl->bitmap_width, vxl->bitmap_height);
+	printf("vxl occupancy: %zd bytes\n", vxl->occupancy_size * sizeof *vxl->occupancy);
+	printf("vxl views: %d; %zd bytes in all\n", vxl->n_views, vxl_memory_usage(vxl));
+	#endif
 
-		for (int az = -1; az <= 1; az++) {
-			for (int ay = -1; ay <= 1; ay++) {
-				for (int ax = -1; ax <= 1; ax++) {
-					int x1 = x+ax;
-					int y1 = y+ay;
-					int z1 = z+az;
-					if (x1 < 0 && x1 >= vxl->dim_x) continue;
-					if (y1 < 0 && y1 >= vxl->dim_y) continue;
-					if (z1 < 0 && z1 >= vxl->dim_z) continue;
-
-					union ivec3* s = &vxl->shade_queue[vxl->shade_queue_len++];
-					s->x = x1;
-					s->y = y1;
-					s->z = z1;
-				}
-			}
-		}
-	}
+	vxl_set_threads(vxl, 0);
+}
 
-	{
-		union ivec3* r = &vxl->render_queue[vxl->render_queue_len++];
-		*r = ref;
-		as_diagonal(
-			-vxl->rotation_vx, -vxl->rotation_vy, 1,
-			vxl->dim_x, vxl->dim_y, vxl->dim_z,
-			&r->x, &r->y, &r->z);
+void vxl_free(struct vxl* vxl)
+{
+	pool_free(vxl->pool);
+	save_view(vxl, &vxl->views[shown_view_index(vxl)]);
+	for (int i = 0; i < vxl->n_views; i++) view_free(vxl, &vxl->views[i]);
+	for (int i = 0; i < vxl->n_chunks; i++) {
+		release_block(vxl, vxl->chunk_data, i, 0);
+		release_block(vxl, vxl->chunk_faces, i, 0);
 	}
+	free(vxl->chunk_data);
+	free(vxl->chunk_faces);
+	free(vxl->uniform);
+	free(vxl->chunk_solid);
+	free(vxl->colors);
+	dirty_free(&vxl->shade_dirty);
+	dirty_free(&vxl->render_dirty);
+	free(vxl->verify_bitmap);
+	memset(vxl, 0, sizeof *vxl);
+}
+
+#define XA_VXYZ(vx,vy,vz) XA(((vx) == 1 || (vx) == -1) && ((vy) == 1 || (vy) == -1) && ((vz) == 1 || (vz) == -1))
 
-	return ret;
+// diagonal distance to edge of AABB with dimensions [dx,dy,dz] along vector
+// [vx,vy,vz] from position [x,y,z]. (not eucledean distance; 3 steps along
+// [vx,vy,vz] means 3 is returned)
+static inline int diagonal_dist(int vx, int vy, int vz, int dx, int dy, int dz, int x, int y, int z)
+{
+	XA_VXYZ(vx, vy, vz);
+	int nx = (vx<0) ? (x) : (dx-x-1);
+	int ny = (vy<0) ? (y) : (dy-y-1);
+	int nz = (vz<0) ? (z) : (dz-z-1);
+	return MIN(nx, MIN(ny, nz));
+}
+
+static inline void as_diagonal(int vx, int vy, int vz, int dx, int dy, int dz, int* x, int* y, int* z)
+{
+	XA_VXYZ(vx, vy, vz);
+	int n = diagonal_dist(vx, vy, vz, dx, dy, dz, *x, *y, *z);
+	*x += vx*n;
+	*y += vy*n;
+	*z += vz*n;
+}
+
+// no bounds check needed as far as the guard band reaches, i.e. for face
+// neighbours of world voxels
+static inline int is_air(struct vxl* vxl, int x, int y, int z)
+{
+	return vxl_get(vxl, x, y, z) == 0;
+}
+
+// the scalar reference; see also faces_chunk()
+static inline u8 get_faces(struct vxl* vxl, int x, int y, int z)
+{
+	if (is_air(vxl, x, y, z)) return 0;
+	return
+		  (is_air(vxl, x-1, y,   z  ) ? FACE_XN : 0)
+		| (is_air(vxl, x+1, y,   z  ) ? FACE_XP : 0)
+		| (is_air(vxl, x,   y-1, z  ) ? FACE_YN : 0)
+		| (is_air(vxl, x,   y+1, z  ) ? FACE_YP : 0)
+		| (is_air(vxl, x,   y,   z-1) ? FACE_ZN : 0)
+		| (is_air(vxl, x,   y,   z+1) ? FACE_ZP : 0);
+}
+
+static inline void update_faces(struct vxl* vxl, int x, int y, int z)
+{
+	int idx = vxl_idx(vxl, x, y, z);
+	u8 faces = get_faces(vxl, x, y, z);
+	if (vxl_faces(vxl, idx) == faces) return;
+	own_block(vxl, vxl->chunk_faces, idx >> CHUNK_VOLUME_LOG2)[idx & (CHUNK_VOLUME-1)] = faces;
+}
+
+/*
+
+CHUNK FACES KERNEL
+
+faces_chunk() does what update_faces() does for every voxel in a chunk, but
+a chunk row (CHUNK_LENGTH voxels along X, which are contiguous in memory) at
+a time, building the masks with lane arithmetic instead of branches. Rows
+are u64s with one voxel per byte (little-endian, so byte i is x=i); the
+neighbour rows are, relative to the row itself:
+ - X-/X+: the row shifted one byte, plus one byte from the neighbouring chunk
+ - Y-/Y+: the previous/next row, possibly in the neighbouring chunk
+ - Z-/Z+: the same row in the layer below/above, possibly in that chunk
+Neighbouring chunks outside the world are guard chunks (see CHUNK STORAGE),
+so they read as uniform air without bounds checks.
+
+Rows are only u64s in the default layout (8³ chunks, linear order); with
+other chunk sizes or VXL_MORTON, faces_chunk() loops over get_faces()
+instead, but still shares uniform blocks like the kernel does.
+
+*/
+
+#if CHUNK_LENGTH == 8 && !defined(VXL_MORTON)
+#define FACES_KERNEL
+#endif
+
+#ifdef FACES_KERNEL
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "faces_chunk() assumes little-endian rows"
+#endif
+
+#define LANES(b) ((u64)(b) * 0x0101010101010101ULL)
+
+static inline u64 load_row(const u8* p)
+{
+	u64 row;
+	memcpy(&row, p, sizeof row);
+	return row;
+}
+
+static inline void store_row(u8* p, u64 row)
+{
+	memcpy(p, &row, sizeof row);
+}
+
+// 0x01 in bytes of v that are zero, 0x00 elsewhere
+static inline u64 zero_lanes(u64 v)
+{
+	const u64 m = LANES(0x7f);
+	return ~(((v & m) + m) | v | m) >> 7;
+}
+
+// get_faces() for 8 voxels given the voxels and their neighbour rows
+static inline u64 faces_row(u64 self, const u64* n)
+{
+	u64 faces =
+		  zero_lanes(n[0]) * FACE_XN
+		| zero_lanes(n[1]) * FACE_XP
+		| zero_lanes(n[2]) * FACE_YN
+		| zero_lanes(n[3]) * FACE_YP
+		| zero_lanes(n[4]) * FACE_ZN
+		| zero_lanes(n[5]) * FACE_ZP;
+	u64 air = zero_lanes(self) * 0xff;
+	return faces & ~air;
+}
+
+#ifdef __SSE2__
+// faces_row() for two rows at a time; n[i] holds neighbour i of both
+static inline __m128i faces_row2(__m128i self, const __m128i* n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i faces = zero;
+	for (int i = 0; i < 6; i++) {
+		faces = _mm_or_si128(faces, _mm_and_si128(_mm_cmpeq_epi8(n[i], zero), _mm_set1_epi8(1<<i)));
+	}
+	return _mm_andnot_si128(_mm_cmpeq_epi8(self, zero), faces);
+}
+#endif
+
+#endif // FACES_KERNEL
+
+// data block of chunk [cx,cy,cz]; uniform air in the guard band
+static inline const u8* chunk_block(struct vxl* vxl, int cx, int cy, int cz)
+{
+	return vxl->chunk_data[vxl_chunk_idx(vxl, cx, cy, cz)];
+}
+
+static inline int chunk_is_full(struct vxl* vxl, int cx, int cy, int cz)
+{
+	return vxl_chunk_state(vxl, vxl_chunk_idx(vxl, cx, cy, cz)) == VXL_CHUNK_FULL;
+}
+
+// computes the face masks of all voxels in a chunk. returns the number of
+// voxels done
+static int faces_chunk(struct vxl* vxl, int chunk_index)
+{
+	int cx, cy, cz;
+	vxl_chunk_xyz(vxl, chunk_index, &cx, &cy, &cz);
+
+	// air has no faces, and neither has a full chunk surrounded by full
+	// chunks
+	const int state = vxl_chunk_state(vxl, chunk_index);
+	if (state == VXL_CHUNK_EMPTY
+		|| (state == VXL_CHUNK_FULL
+		&& chunk_is_full(vxl, cx-1, cy, cz) && chunk_is_full(vxl, cx+1, cy, cz)
+		&& chunk_is_full(vxl, cx, cy-1, cz) && chunk_is_full(vxl, cx, cy+1, cz)
+		&& chunk_is_full(vxl, cx, cy, cz-1) && chunk_is_full(vxl, cx, cy, cz+1))) {
+		release_block(vxl, vxl->chunk_faces, chunk_index, 0);
+		return CHUNK_VOLUME;
+	}
+
+	u8 faces[CHUNK_VOLUME];
+
+	#ifdef FACES_KERNEL
+	const u8* chunk = vxl->chunk_data[chunk_index];
+	const u8* chunk_xn = chunk_block(vxl, cx-1, cy, cz);
+	const u8* chunk_xp = chunk_block(vxl, cx+1, cy, cz);
+	const u8* chunk_yn = chunk_block(vxl, cx, cy-1, cz);
+	const u8* chunk_yp = chunk_block(vxl, cx, cy+1, cz);
+	const u8* chunk_zn = chunk_block(vxl, cx, cy, cz-1);
+	const u8* chunk_zp = chunk_block(vxl, cx, cy, cz+1);
+
+	for (int lz = 0; lz < CHUNK_LENGTH; lz++) {
+		u64 self[CHUNK_LENGTH];
+		// neighbour rows in FACE_* bit order, interleaved by row
+		u64 n[6][CHUNK_LENGTH];
+
+		const u8* layer_zn = lz > 0 ? chunk : chunk_zn;
+		const u8* layer_zp = lz < CHUNK_LENGTH_MASK ? chunk : chunk_zp;
+
+		for (int ly = 0; ly < CHUNK_LENGTH; ly++) {
+			const u8* layer_yn = ly > 0 ? chunk : chunk_yn;
+			const u8* layer_yp = ly < CHUNK_LENGTH_MASK ? chunk : chunk_yp;
+
+			const int row = vxl_local_idx(vxl, 0, ly, lz);
+			const u64 s = self[ly] = load_row(&chunk[row]);
+			n[0][ly] = (s << 8) | (u64)chunk_xn[row + CHUNK_LENGTH_MASK];
+			n[1][ly] = (s >> 8) | ((u64)chunk_xp[row] << 56);
+			n[2][ly] = load_row(&layer_yn[vxl_local_idx(vxl, 0, (ly-1) & CHUNK_LENGTH_MASK, lz)]);
+			n[3][ly] = load_row(&layer_yp[vxl_local_idx(vxl, 0, (ly+1) & CHUNK_LENGTH_MASK, lz)]);
+			n[4][ly] = load_row(&layer_zn[vxl_local_idx(vxl, 0, ly, (lz-1) & CHUNK_LENGTH_MASK)]);
+			n[5][ly] = load_row(&layer_zp[vxl_local_idx(vxl, 0, ly, (lz+1) & CHUNK_LENGTH_MASK)]);
+		}
+
+		u8* out = &faces[vxl_local_idx(vxl, 0, 0, lz)];
+		#ifdef __SSE2__
+		for (int ly = 0; ly < CHUNK_LENGTH; ly += 2) {
+			__m128i nn[6];
+			for (int i = 0; i < 6; i++) nn[i] = _mm_loadu_si128((__m128i*)&n[i][ly]);
+			__m128i f = faces_row2(_mm_loadu_si128((__m128i*)&self[ly]), nn);
+			_mm_storeu_si128((__m128i*)&out[ly << CHUNK_LENGTH_LOG2], f);
+		}
+		#else
+		for (int ly = 0; ly < CHUNK_LENGTH; ly++) {
+			u64 nn[6];
+			for (int i = 0; i < 6; i++) nn[i] = n[i][ly];
+			store_row(&out[ly << CHUNK_LENGTH_LOG2], faces_row(self[ly], nn));
+		}
+		#endif
+	}
+	#else
+	cx *= CHUNK_LENGTH;
+	cy *= CHUNK_LENGTH;
+	cz *= CHUNK_LENGTH;
+	for (int lz = 0; lz < CHUNK_LENGTH; lz++) {
+		for (int ly = 0; ly < CHUNK_LENGTH; ly++) {
+			for (int lx = 0; lx < CHUNK_LENGTH; lx++) {
+				faces[vxl_local_idx(vxl, lx, ly, lz)] = get_faces(vxl, cx+lx, cy+ly, cz+lz);
+			}
+		}
+	}
+	#endif
+
+	store_block(vxl, vxl->chunk_faces, chunk_index, faces);
+
+	return CHUNK_VOLUME;
+}
+
+#ifdef DEBUG
+// compares a chunk's face masks against the scalar reference
+static void check_chunk_faces(struct vxl* vxl, int chunk_index)
+{
+	int cx, cy, cz;
+	vxl_chunk_xyz(vxl, chunk_index, &cx, &cy, &cz);
+	const u8* faces = vxl->chunk_faces[chunk_index];
+	for (int lz = 0; lz < CHUNK_LENGTH; lz++) {
+		for (int ly = 0; ly < CHUNK_LENGTH; ly++) {
+			for (int lx = 0; lx < CHUNK_LENGTH; lx++) {
+				int x = (cx << CHUNK_LENGTH_LOG2) + lx;
+				int y = (cy << CHUNK_LENGTH_LOG2) + ly;
+				int z = (cz << CHUNK_LENGTH_LOG2) + lz;
+				XA(faces[vxl_local_idx(vxl, lx, ly, lz)] == get_faces(vxl, x, y, z));
+			}
+		}
+	}
+}
+#endif
+
+// bitmap position of the fat pixel for voxel [x,y,z]; all voxels on a view
+// diagonal share it
+static inline void project(struct vxl* vxl, int x, int y, int z, int* sx, int* sy)
+{
+	int xq = x;
+	int yq = y;
+	int zq = z;
+
+	int dxq = vxl->dim_x;
+	int dyq = vxl->dim_y;
+	int dzq = vxl->dim_z;
+
+	// rotate back into the rotation 0 frame (inverse of the view vector
+	// rotation in vxl_set_rotation()), where the view is [-1,-1,-1] and
+	// the projection below holds
+	for (int i = 0; i < vxl->rotation; i++) {
+		int tmp = xq;
+		xq = dyq-1-yq;
+		yq = tmp;
+		tmp = dxq;
+		dxq = dyq;
+		dyq = tmp;
+	}
+
+	*sx = 2*(dyq-1+xq-yq);
+	*sy = (xq+yq) + 2*(dzq-1-zq);
+}
+
+/*
+
+OCCUPANCY
+
+vxl->occupancy has one bit per voxel telling whether it's solid, ordered by
+view diagonal for the current rotation: each diagonal has occupancy_words
+u64s, and bit i is the voxel i steps from the start of the diagonal (the end
+nearest the camera). So the first solid voxel along a diagonal is found 64
+voxels at a time with ctz.
+
+Diagonals are keyed by their fat pixel; a fat pixel's sx is always even and
+fat pixels in the same row are 4 apart, so a row needs (dim_x+dim_y)/2
+slots. vxl_put() keeps the bits current, which makes them a diagonal-major
+mirror of which voxels are solid, and a full update only rebuilds them from
+vxl->chunk_data when they've gone stale: after the rotation changed, or when
+so many voxels were put in "full update" mode that rebuilding is cheaper than
+syncing each put (OCCUPANCY_SYNC_SHIFT).
+
+vxl->depths caches the depth of each diagonal's first solid voxel, i.e. the
+voxel its fat pixel shows. Full renders find it with first_hit(); after that
+vxl_put() keeps it current: a voxel put behind it changes nothing visible and
+isn't queued at all, a solid voxel put in front of it becomes the new hit, and
+only when the hit itself turns to air is the diagonal searched again, from
+there on. Queued diagonals are then drawn from the cached depth.
+
+*/
+
+// the slot of the diagonal whose fat pixel is at [sx,sy]
+static inline int diagonal_slot(struct vxl* vxl, int sx, int sy)
+{
+	return sy * vxl->occupancy_row + (sx >> 2);
+}
+
+// inverse of diagonal_slot(), given the row; sx/2 has the parity of
+// dyq-1+sy (see project()), where dyq is dim_y rotated into rotation 0
+static inline int slot_sx(struct vxl* vxl, int sy, int column)
+{
+	const int dyq = (vxl->rotation & 1) ? vxl->dim_x : vxl->dim_y;
+	return (column << 2) + (((dyq - 1 + sy) & 1) << 1);
+}
+
+// the slot of the diagonal through [x,y,z]
+static inline int voxel_slot(struct vxl* vxl, int x, int y, int z)
+{
+	int sx, sy;
+	project(vxl, x, y, z, &sx, &sy);
+	return diagonal_slot(vxl, sx, sy);
+}
+
+static inline u64* occupancy_diagonal(struct vxl* vxl, int x, int y, int z)
+{
+	return &vxl->occupancy[voxel_slot(vxl, x, y, z) * vxl->occupancy_words];
+}
+
+#define NO_HIT (0xffff)
+
+// depth of the first solid voxel at depth0 or deeper on the diagonal with
+// occupancy words, or NO_HIT
+static inline int first_hit(struct vxl* vxl, const u64* words, int depth0)
+{
+	int i = depth0 >> 6;
+	if (i >= vxl->occupancy_words) return NO_HIT;
+	u64 word = words[i] & (~(u64)0 << (depth0 & 63));
+	for (;;) {
+		if (word != 0) return (i << 6) + __builtin_ctzll(word);
+		if (++i == vxl->occupancy_words) return NO_HIT;
+		word = words[i];
+	}
+}
+
+// steps from the start of the diagonal to [x,y,z]
+static inline int occupancy_depth(struct vxl* vxl, int x, int y, int z)
+{
+	return diagonal_dist(
+		-vxl->rotation_vx, -vxl->rotation_vy, 1,
+		vxl->dim_x, vxl->dim_y, vxl->dim_z,
+		x, y, z);
+}
+
+// sets or clears the occupancy bit of [x,y,z] after its voxel changed
+static inline void occupancy_update(struct vxl* vxl, int x, int y, int z)
+{
+	const int depth = occupancy_depth(vxl, x, y, z);
+	u64* word = &occupancy_diagonal(vxl, x, y, z)[depth >> 6];
+	const u64 mask = (u64)1 << (depth & 63);
+	if (vxl_get(vxl, x, y, z)) {
+		*word |= mask;
+	} else {
+		*word &= ~mask;
+	}
+}
+
+// rebuilding costs about as much as syncing puts to a fifth of the world, so
+// stop syncing beyond 1/2^OCCUPANCY_SYNC_SHIFT of it
+#define OCCUPANCY_SYNC_SHIFT (3)
+
+// true if n more voxels put in "full update" mode should be synced into
+// occupancy; gives up on the bits (they're rebuilt) past the budget
+static inline int occupancy_sync(struct vxl* vxl, int n)
+{
+	if (vxl->occupancy_stale) return 0;
+	vxl->occupancy_synced += n;
+	if (vxl->occupancy_synced > (vxl->dim_x * vxl->dim_y * vxl->dim_z) >> OCCUPANCY_SYNC_SHIFT) {
+		vxl->occupancy_stale = 1;
+		return 0;
+	}
+	return 1;
+}
+
+#define CHUNK_ENTRIES (CHUNK_VOLUME - (CHUNK_LENGTH-1)*(CHUNK_LENGTH-1)*(CHUNK_LENGTH-1))
+
+// a voxel where a view diagonal enters a chunk, how many voxels of the chunk
+// the diagonal passes through from there, and its project() offset from the
+// chunk origin
+struct chunk_entry {
+	int lx, ly, lz;
+	int len;
+	int dsx, dsy;
+};
+
+// finds the CHUNK_ENTRIES entries for the current rotation
+static void get_chunk_entries(struct vxl* vxl, struct chunk_entry* entries)
+{
+	const int vx = vxl->rotation_vx;
+	const int vy = vxl->rotation_vy;
+	const int xface = vx < 0 ? CHUNK_LENGTH_MASK : 0;
+	const int yface = vy < 0 ? CHUNK_LENGTH_MASK : 0;
+	int sx0, sy0;
+	project(vxl, 0, 0, 0, &sx0, &sy0);
+	int n = 0;
+	for (int lz = 0; lz < CHUNK_LENGTH; lz++) {
+		for (int ly = 0; ly < CHUNK_LENGTH; ly++) {
+			for (int lx = 0; lx < CHUNK_LENGTH; lx++) {
+				if (lz != CHUNK_LENGTH_MASK && ly != yface && lx != xface) continue;
+				struct chunk_entry* e = &entries[n++];
+				e->lx = lx;
+				e->ly = ly;
+				e->lz = lz;
+				e->len = 1 + diagonal_dist(
+					vx, vy, -1,
+					CHUNK_LENGTH, CHUNK_LENGTH, CHUNK_LENGTH,
+					lx, ly, lz);
+				project(vxl, lx, ly, lz, &e->dsx, &e->dsy);
+				e->dsx -= sx0;
+				e->dsy -= sy0;
+			}
+		}
+	}
+	assert(n == CHUNK_ENTRIES);
+}
+
+static inline void or_word(u64* word, u64 bits, int atomic)
+{
+	if (atomic) {
+		__atomic_fetch_or(word, bits, __ATOMIC_RELAXED);
+	} else {
+		*word |= bits;
+	}
+}
+
+// ORs a chunk's solid voxels into vxl->occupancy, one diagonal at a time. ORs
+// must be atomic if other threads add chunks at the same time, because
+// diagonals cross chunks
+static void occupancy_add_chunk(struct vxl* vxl, int chunk_index, const struct chunk_entry* entries, int atomic)
+{
+	const int state = vxl_chunk_state(vxl, chunk_index);
+	if (state == VXL_CHUNK_EMPTY) return;
+
+	const int vx = vxl->rotation_vx;
+	const int vy = vxl->rotation_vy;
+
+	int cx, cy, cz;
+	vxl_chunk_xyz(vxl, chunk_index, &cx, &cy, &cz);
+	cx <<= CHUNK_LENGTH_LOG2;
+	cy <<= CHUNK_LENGTH_LOG2;
+	cz <<= CHUNK_LENGTH_LOG2;
+
+	const u8* chunk = vxl->chunk_data[chunk_index];
+
+	// project() is affine, so entries are projected relative to this
+	int sx0, sy0;
+	project(vxl, cx, cy, cz, &sx0, &sy0);
+
+	for (int i = 0; i < CHUNK_ENTRIES; i++) {
+		const struct chunk_entry* e = &entries[i];
+		u64 bits;
+		if (state == VXL_CHUNK_FULL) {
+			bits = ((u64)1 << e->len) - 1;
+		} else {
+			bits = 0;
+			for (int k = 0; k < e->len; k++) {
+				u8 v = chunk[vxl_local_idx(vxl, e->lx + k*vx, e->ly + k*vy, e->lz - k)];
+				bits |= (u64)(v != 0) << k;
+			}
+			if (bits == 0) continue;
+		}
+
+		const int sx = sx0 + e->dsx;
+		const int sy = sy0 + e->dsy;
+		u64* words = &vxl->occupancy[diagonal_slot(vxl, sx, sy) * vxl->occupancy_words];
+		XA(words == occupancy_diagonal(vxl, cx + e->lx, cy + e->ly, cz + e->lz));
+		const int depth = occupancy_depth(vxl, cx + e->lx, cy + e->ly, cz + e->lz);
+		const int word = depth >> 6;
+		const int bit = depth & 63;
+		or_word(&words[word], bits << bit, atomic);
+		if (bit + e->len > 64) {
+			or_word(&words[word+1], bits >> (64-bit), atomic);
+		}
+	}
+}
+
+static inline void draw_fat_pixel(struct vxl* vxl, int sx, int sy, u32 rgba0, u32 rgba1)
+{
+	const int w = vxl->bitmap_width;
+	u32* pixel = &vxl->bitmap[sx + sy*w];
+	pixel[0]   = rgba0;
+	pixel[1]   = rgba1;
+	pixel[w]   = rgba0;
+	pixel[w+1] = rgba1;
+}
+
+// draws the diagonal starting at [x,y,z] from its cached depth
+static inline void draw_diagonal(struct vxl* vxl, int x, int y, int z)
+{
+	const int vx = vxl->rotation_vx;
+	const int vy = vxl->rotation_vy;
+
+	XA(occupancy_depth(vxl, x, y, z) == 0);
+
+	int sx, sy;
+	project(vxl, x, y, z, &sx, &sy);
+
+	u32 rgba0 = 0;
+	u32 rgba1 = 0;
+	u16 hit = 0;
+
+	const int slot = diagonal_slot(vxl, sx, sy);
+	const int depth = vxl->depths[slot];
+	XA(depth == first_hit(vxl, &vxl->occupancy[slot * vxl->occupancy_words], 0));
+	if (depth != NO_HIT) {
+		XA(depth <= diagonal_dist(vx, vy, -1, vxl->dim_x, vxl->dim_y, vxl->dim_z, x, y, z));
+		const int idx = vxl_idx(vxl, x + depth*vx, y + depth*vy, z - depth);
+		const u8 voxel = vxl_data(vxl, idx);
+		const u8 shade = vxl->face_shade[vxl_faces(vxl, idx)];
+		XA(voxel != 0);
+		XA(shade < N_SHADES);
+		const u32* colors = get_colors(vxl, voxel, shade);
+		rgba0 = colors[0];
+		rgba1 = colors[1];
+		hit = make_hit(voxel, shade);
+	}
+
+	XA(sx >= 0);
+	XA(sy >= 0);
+	XA(sx < vxl->bitmap_width);
+	XA(sy < vxl->bitmap_height);
+
+	vxl->hits[slot] = hit;
+	draw_fat_pixel(vxl, sx, sy, rgba0, rgba1);
+}
+
+// finds the first hit of the diagonal starting at [x,y,z] and draws it
+static inline void render_diagonal(struct vxl* vxl, int x, int y, int z)
+{
+	const int slot = voxel_slot(vxl, x, y, z);
+	vxl->depths[slot] = first_hit(vxl, &vxl->occupancy[slot * vxl->occupancy_words], 0);
+	draw_diagonal(vxl, x, y, z);
+}
+
+static int repaint_job(struct vxl* vxl, void* usr, int sy0, int sy1)
+{
+	int n = 0;
+	for (int sy = sy0; sy < sy1; sy++) {
+		for (int column = 0; column < vxl->occupancy_row; column++) {
+			const int sx = slot_sx(vxl, sy, column);
+			const u16 hit = vxl->hits[diagonal_slot(vxl, sx, sy)];
+			if (!vxl->palette_dirty[hit_material(hit)]) continue;
+			const u32* colors = get_colors(vxl, hit_material(hit), hit & 0xff);
+			draw_fat_pixel(vxl, sx, sy, colors[0], colors[1]);
+			n++;
+		}
+	}
+	return n;
+}
+
+// n'th chunk on the camera facing sides of the chunk grid; walking from it in
+// [vx,vy,-1] chunk steps visits one "chunk diagonal", and the chunk
+// diagonals partition the chunks
+static inline void chunk_diagonal_start(struct vxl* vxl, int n, int* cx, int* cy, int* cz)
+{
+	const int cdx = vxl->chunk_dim_x;
+	const int cdy = vxl->chunk_dim_y;
+	const int cdz = vxl->chunk_dim_z;
+	const int xfront = vxl->rotation_vx < 0 ? cdx-1 : 0;
+	const int yfront = vxl->rotation_vy < 0 ? cdy-1 : 0;
+
+	// top
+	if (n < cdx*cdy) {
+		*cx = n % cdx;
+		*cy = n / cdx;
+		*cz = cdz-1;
+		return;
+	}
+
+	// sides
+	n -= cdx*cdy;
+	const int layer = cdx+cdy-1;
+	*cz = cdz-2 - n/layer;
+	n %= layer;
+	if (n < cdx) {
+		*cx = n;
+		*cy = yfront;
+	} else {
+		n -= cdx;
+		*cx = xfront;
+		*cy = n < yfront ? n : n+1;
+	}
+}
+
+struct chunk_solid_pass {
+	const struct chunk_entry* entries;
+	// also recount chunk_solid; off when only the rotation changed
+	int recount;
+};
+
+// recounts vxl->chunk_solid, gives back uniform data blocks and rebuilds
+// vxl->occupancy (which must be cleared first); vxl_put() only counts in
+// "full update" mode. a diagonal's occupancy words are
+// mostly shared with the chunks in front of and behind it, so chunks are
+// visited one chunk diagonal at a time to keep them in cache
+static int chunk_solid_job(struct vxl* vxl, void* usr, int i0, int i1)
+{
+	const struct chunk_solid_pass* pass = usr;
+	const int vx = vxl->rotation_vx;
+	const int vy = vxl->rotation_vy;
+	for (int i = i0; i < i1; i++) {
+		int cx, cy, cz;
+		chunk_diagonal_start(vxl, i, &cx, &cy, &cz);
+		while (cx >= 0 && cy >= 0 && cz >= 0 && cx < vxl->chunk_dim_x && cy < vxl->chunk_dim_y) {
+			const int chunk_index = vxl_chunk_idx(vxl, cx, cy, cz);
+			if (pass->recount) {
+				const u8* p = vxl->chunk_data[chunk_index];
+				int n = 0;
+				if (is_uniform_block(vxl, p)) {
+					n = p[0] ? CHUNK_VOLUME : 0;
+				} else {
+					for (int j = 0; j < CHUNK_VOLUME; j++) n += p[j] != 0;
+					if (n == 0 || n == CHUNK_VOLUME) compact_block(vxl, vxl->chunk_data, chunk_index);
+				}
+				vxl->chunk_solid[chunk_index] = n;
+			}
+			occupancy_add_chunk(vxl, chunk_index, pass->entries, vxl->pool != NULL);
+			cx += vx;
+			cy += vy;
+			cz--;
+		}
+	}
+	return 0;
+}
+
+static inline int faces_chunk_job(struct vxl* vxl, void* usr, int i0, int i1)
+{
+	int n = 0;
+	for (int i = i0; i < i1; i++) {
+		const int chunk_index = world_chunk(vxl, i);
+		n += faces_chunk(vxl, chunk_index);
+		#ifdef DEBUG
+		check_chunk_faces(vxl, chunk_index);
+		#endif
+	}
+	return n;
+}
+
+// updates the faces of chunk layers [cz0;cz1). scalar reference for
+// faces_chunk_job(). split by chunk layer since update_faces() may give
+// chunks their own faces block
+static inline int faces_slab_job(struct vxl* vxl, void* usr, int cz0, int cz1)
+{
+	const int dx = vxl->dim_x;
+	const int dy = vxl->dim_y;
+	const int z0 = cz0 << CHUNK_LENGTH_LOG2;
+	const int z1 = cz1 << CHUNK_LENGTH_LOG2;
+
+	for (int z = z0; z < z1; z++) {
+		for (int y = 0; y < dy; y++) {
+			for (int x = 0; x < dx; x++) {
+				update_faces(vxl, x, y, z);
+			}
+		}
+	}
+
+	return dx * dy * (z1-z0);
+}
+
+static int render_top_job(struct vxl* vxl, void* usr, int v0, int v1)
+{
+	for (int v = v0; v < v1; v++) {
+		for (int u = 0; u < vxl->dim_x; u++) {
+			render_diagonal(vxl, u, v, vxl->dim_z-1);
+		}
+	}
+	return 0;
+}
+
+static int render_sides_job(struct vxl* vxl, void* usr, int v0, int v1)
+{
+	const int dx = vxl->dim_x;
+	const int dy = vxl->dim_y;
+	const int xfront = vxl->rotation_vx < 0 ? dx-1 : 0;
+	const int yfront = vxl->rotation_vy < 0 ? dy-1 : 0;
+	for (int v = v0; v < v1; v++) {
+		for (int u = 0; u < dx; u++) {
+			render_diagonal(vxl, u, yfront, v);
+		}
+
+		for (int u = 0; u < dy; u++) {
+			// (xfront,yfront,v) was rendered by the loop above
+			if (u == yfront) continue;
+			render_diagonal(vxl, xfront, u, v);
+		}
+	}
+	return 0;
+}
+
+static int faces_dirty_job(struct vxl* vxl, void* usr, int i0, int i1)
+{
+	struct vxl_dirty* d = &vxl->shade_dirty;
+	#ifdef VXL_SCALAR_SHADE
+	return dirty_walk(vxl, d, update_faces, i0, i1);
+	#else
+	// chunks marked whole (typically by box edits) go through the kernel
+	int n = 0;
+	for (int i = i0; i < i1; i++) {
+		const int chunk_index = d->chunks[i];
+		if (!dirty_chunk_full(d, chunk_index)) {
+			n += dirty_walk(vxl, d, update_faces, i, i+1);
+			continue;
+		}
+		d->chunk_flags[chunk_index] = 0;
+		memset(&d->bits[chunk_index * CHUNK_WORDS], 0, CHUNK_WORDS * sizeof *d->bits);
+		n += faces_chunk(vxl, chunk_index);
+	}
+	return n;
+	#endif
+}
+
+static int render_dirty_job(struct vxl* vxl, void* usr, int i0, int i1)
+{
+	return dirty_walk(vxl, &vxl->render_dirty, draw_diagonal, i0, i1);
+}
+
+static void clear_bitmap(struct vxl* vxl)
+{
+	memset(vxl->bitmap, 0, vxl->bitmap_width * vxl->bitmap_height * sizeof(*vxl->bitmap));
+	memset(vxl->hits, 0, vxl->bitmap_height * vxl->occupancy_row * sizeof(*vxl->hits));
+}
+
+/*
+
+DAMAGE
+
+vxl_flush() adds the bitmap rectangles it may have drawn to to vxl->damage
+so that callers can copy/upload only those. Incremental flushes add the
+projected bounding box of each chunk in render_dirty, i.e. of the fat
+pixels of all diagonals starting in it; full updates and repaints damage
+the whole bitmap. The list has VXL_MAX_DAMAGE rectangles at most, so when
+it is full a new rectangle is merged into the one it grows the least.
+
+*/
+
+static inline int rect_area(struct vxl_rect r)
+{
+	return (r.x1 - r.x0) * (r.y1 - r.y0);
+}
+
+static inline struct vxl_rect rect_union(struct vxl_rect a, struct vxl_rect b)
+{
+	struct vxl_rect r;
+	r.x0 = MIN(a.x0, b.x0);
+	r.y0 = MIN(a.y0, b.y0);
+	r.x1 = MAX(a.x1, b.x1);
+	r.y1 = MAX(a.y1, b.y1);
+	return r;
+}
+
+static void add_damage(struct vxl* vxl, struct vxl_rect r)
+{
+	int best = -1;
+	int best_growth = 0;
+	for (int i = 0; i < vxl->n_damage; i++) {
+		struct vxl_rect* d = &vxl->damage[i];
+		int growth = rect_area(rect_union(*d, r)) - rect_area(*d);
+		if (growth == 0) return; // already covered
+		if (best < 0 || growth < best_growth) {
+			best = i;
+			best_growth = growth;
+		}
+	}
+	if (vxl->n_damage < VXL_MAX_DAMAGE) {
+		vxl->damage[vxl->n_damage++] = r;
+	} else {
+		vxl->damage[best] = rect_union(vxl->damage[best], r);
+	}
+}
+
+static void damage_all(struct vxl* vxl)
+{
+	struct vxl_rect r = {0, 0, vxl->bitmap_width, vxl->bitmap_height};
+	vxl->damage[0] = r;
+	vxl->n_damage = 1;
+}
+
+static void damage_chunk(struct vxl* vxl, int chunk_index)
+{
+	int cx, cy, cz;
+	vxl_chunk_xyz(vxl, chunk_index, &cx, &cy, &cz);
+	struct vxl_rect r = {INT_MAX, INT_MAX, INT_MIN, INT_MIN};
+	for (int corner = 0; corner < 8; corner++) {
+		int x = (cx << CHUNK_LENGTH_LOG2) + ((corner & 1) ? CHUNK_LENGTH_MASK : 0);
+		int y = (cy << CHUNK_LENGTH_LOG2) + ((corner & 2) ? CHUNK_LENGTH_MASK : 0);
+		int z = (cz << CHUNK_LENGTH_LOG2) + ((corner & 4) ? CHUNK_LENGTH_MASK : 0);
+		int sx, sy;
+		project(vxl, x, y, z, &sx, &sy);
+		r.x0 = MIN(r.x0, sx);
+		r.y0 = MIN(r.y0, sy);
+		// fat pixels are 2×2
+		r.x1 = MAX(r.x1, sx + 2);
+		r.y1 = MAX(r.y1, sy + 2);
+	}
+	add_damage(vxl, r);
+}
+
+static void clear_palette_dirty(struct vxl* vxl)
+{
+	memset(vxl->palette_dirty, 0, sizeof vxl->palette_dirty);
+	vxl->palette_changed = 0;
+}
+
+void vxl_set_palette(struct vxl* vxl, const u32* palette)
+{
+	if (vxl->record != NULL) record_palette(vxl, palette);
+	for (int i = 1; i < 256; i++) {
+		if (palette[i] == vxl->palette[i]) continue;
+		vxl->palette[i] = palette[i];
+		update_colors(vxl, i);
+		vxl->palette_dirty[i] = 1;
+		vxl->palette_changed = 1;
+		for (int j = 0; j < vxl->n_views; j++) {
+			vxl->views[j].palette_dirty[i] = 1;
+			vxl->views[j].palette_changed = 1;
+		}
+	}
+}
+
+// clears the bitmap and, if stale, rebuilds occupancy for the current
+// rotation, and with recount, vxl->chunk_solid too
+static void reset_view(struct vxl* vxl, int recount)
+{
+	clear_bitmap(vxl);
+	clear_palette_dirty(vxl);
+	damage_all(vxl);
+
+	vxl->occupancy_synced = 0;
+	if (!vxl->occupancy_stale) return;
+
+	struct chunk_entry entries[CHUNK_ENTRIES];
+	get_chunk_entries(vxl, entries);
+	struct chunk_solid_pass pass = { .entries = entries, .recount = recount };
+	memset(vxl->occupancy, 0, vxl->occupancy_size * sizeof *vxl->occupancy);
+	pool_for(vxl, chunk_solid_job, &pass, diagonal_count(vxl->chunk_dim_x, vxl->chunk_dim_y, vxl->chunk_dim_z), 8);
+	vxl->occupancy_stale = 0;
+}
+
+// render all diagonals. each diagonal has its own fat pixel, so any split of
+// the diagonals gives threads disjoint parts of the bitmap
+static void render_all(struct vxl* vxl)
+{
+	const int dx = vxl->dim_x;
+	const int dy = vxl->dim_y;
+	const int dz = vxl->dim_z;
+
+	// top
+	pool_for(vxl, render_top_job, NULL, dy, 4);
+
+	// rotation 0 has X+ and Y+ facing the camera, i.e. "d"
+	// through "g" through "4" are visible.
+	//   1234-
+	//   5678-
+	//   9abc-
+	//   defg-
+	//   ||||
+	//
+	// rotation 1 then has Y- and X+ facing the camera
+	//   d951-
+	//   ea62-
+	//   fb73-
+	//   gc84-
+	//   ||||
+
+	// sides
+	pool_for(vxl, render_sides_job, NULL, dz-1, 1);
+
+	vxl->stats.n_rendered += diagonal_count(dx, dy, dz);
+}
+
+/*
+
+SHADOW VERIFICATION
+
+With vxl_set_verify(vxl, n), every n'th vxl_flush() ends by rendering the
+shown view again from scratch and comparing it with vxl->bitmap. The
+reference render shares nothing incremental with the real one: it walks
+each diagonal through vxl_get() instead of occupancy and cached depths, and
+shades its hit with get_faces() instead of chunk_faces. Mismatches are
+counted in vxl->stats, and the first VERIFY_REPORT diagonals that differ are
+printed with their voxel. It's as slow as a scalar full update, and isn't
+counted in the flush times.
+
+*/
+
+#define VERIFY_REPORT (8)
+
+struct verify_mismatch {
+	// start of the diagonal (see as_diagonal()) and its fat pixel
+	int x, y, z;
+	int sx, sy;
+	// the first pixel of the fat pixel that differs
+	u32 got, want;
+	// depth of the first solid voxel, and the cached one
+	int depth, cached_depth;
+};
+
+struct verify_pass {
+	int n_diagonals;
+	struct verify_mismatch mismatches[VERIFY_REPORT];
+};
+
+static void verify_diagonal(struct vxl* vxl, struct verify_pass* pass, int x, int y, int z)
+{
+	const int vx = vxl->rotation_vx;
+	const int vy = vxl->rotation_vy;
+	const int n = diagonal_dist(vx, vy, -1, vxl->dim_x, vxl->dim_y, vxl->dim_z, x, y, z);
+	int depth = NO_HIT;
+	for (int i = 0; i <= n; i++) {
+		if (!is_air(vxl, x + i*vx, y + i*vy, z - i)) {
+			depth = i;
+			break;
+		}
+	}
+
+	u32 rgba0 = 0;
+	u32 rgba1 = 0;
+	if (depth != NO_HIT) {
+		const int hx = x + depth*vx;
+		const int hy = y + depth*vy;
+		const int hz = z - depth;
+		const u32* colors = get_colors(vxl, vxl_get(vxl, hx, hy, hz), vxl->face_shade[get_faces(vxl, hx, hy, hz)]);
+		rgba0 = colors[0];
+		rgba1 = colors[1];
+	}
+
+	int sx, sy;
+	project(vxl, x, y, z, &sx, &sy);
+	const int w = vxl->bitmap_width;
+	u32* ref = &vxl->verify_bitmap[sx + sy*w];
+	ref[0] = ref[w] = rgba0;
+	ref[1] = ref[w+1] = rgba1;
+
+	const u32* pixel = &vxl->bitmap[sx + sy*w];
+	const int offsets[4] = {0, 1, w, w+1};
+	int j = 0;
+	while (j < 4 && pixel[offsets[j]] == ref[offsets[j]]) j++;
+	if (j == 4) return;
+	const int i = __atomic_fetch_add(&pass->n_diagonals, 1, __ATOMIC_RELAXED);
+	if (i >= VERIFY_REPORT) return;
+	struct verify_mismatch* m = &pass->mismatches[i];
+	m->x = x;
+	m->y = y;
+	m->z = z;
+	m->sx = sx;
+	m->sy = sy;
+	m->got = pixel[offsets[j]];
+	m->want = ref[offsets[j]];
+	m->depth = depth;
+	m->cached_depth = vxl->depths[diagonal_slot(vxl, sx, sy)];
+}
+
+// the diagonals starting at height [z0;z1); the same ones render_all() draws
+static int verify_job(struct vxl* vxl, void* usr, int z0, int z1)
+{
+	struct verify_pass* pass = usr;
+	const int dx = vxl->dim_x;
+	const int dy = vxl->dim_y;
+	const int xfront = vxl->rotation_vx < 0 ? dx-1 : 0;
+	const int yfront = vxl->rotation_vy < 0 ? dy-1 : 0;
+	for (int z = z0; z < z1; z++) {
+		for (int y = 0; y < dy; y++) {
+			for (int x = 0; x < dx; x++) {
+				if (z == vxl->dim_z-1 || x == xfront || y == yfront) verify_diagonal(vxl, pass, x, y, z);
+			}
+		}
+	}
+	return 0;
+}
+
+static void verify(struct vxl* vxl)
+{
+	const s64 trace_t0 = trace_begin();
+	const int n_pixels = vxl->bitmap_width * vxl->bitmap_height;
+	memset(vxl->verify_bitmap, 0, n_pixels * sizeof *vxl->verify_bitmap);
+	struct verify_pass pass = { .n_diagonals = 0 };
+	pool_for(vxl, verify_job, &pass, vxl->dim_z, 1);
+
+	// also catches pixels drawn outside of any fat pixel
+	int n_mismatches = 0;
+	for (int i = 0; i < n_pixels; i++) n_mismatches += vxl->bitmap[i] != vxl->verify_bitmap[i];
+	vxl->stats.n_verified++;
+	vxl->stats.n_verify_mismatches += n_mismatches;
+	trace_end("verify", trace_t0);
+	if (n_mismatches == 0) return;
+
+	fprintf(stderr, "vxl verify: flush %d, rotation %d: %d pixels and %d diagonals differ\n",
+		vxl->stats.n_flushes, vxl->rotation, n_mismatches, pass.n_diagonals);
+	for (int i = 0; i < MIN(pass.n_diagonals, VERIFY_REPORT); i++) {
+		const struct verify_mismatch* m = &pass.mismatches[i];
+		fprintf(stderr, "  diagonal [%d,%d,%d] at [%d,%d] is %.8x, should be %.8x; ",
+			m->x, m->y, m->z, m->sx, m->sy, m->got, m->want);
+		if (m->depth == NO_HIT) {
+			fprintf(stderr, "no hit");
+		} else {
+			const int hx = m->x + m->depth*vxl->rotation_vx;
+			const int hy = m->y + m->depth*vxl->rotation_vy;
+			const int hz = m->z - m->depth;
+			const int idx = vxl_idx(vxl, hx, hy, hz);
+			fprintf(stderr, "hit [%d,%d,%d] = %d, faces %.2x (cached %.2x)",
+				hx, hy, hz, vxl_data(vxl, idx), get_faces(vxl, hx, hy, hz), vxl_faces(vxl, idx));
+		}
+		if (m->cached_depth != m->depth) {
+			fprintf(stderr, "; cached depth %d, should be %d", m->cached_depth, m->depth);
+		}
+		fprintf(stderr, "\n");
+	}
+}
+
+void vxl_set_verify(struct vxl* vxl, int interval)
+{
+	vxl->verify_interval = MAX(interval, 0);
+	vxl->verify_countdown = vxl->verify_interval;
+	free(vxl->verify_bitmap);
+	vxl->verify_bitmap = NULL;
+	if (vxl->verify_interval > 0) {
+		assert((vxl->verify_bitmap = malloc(vxl->bitmap_width * vxl->bitmap_height * sizeof *vxl->verify_bitmap)) != NULL);
+	}
+}
+
+static void flush(struct vxl* vxl)
+{
+	struct vxl_stats* stats = &vxl->stats;
+	const s64 t0 = trace_now_ns();
+	const s64 trace_t0 = trace_begin();
+	const int full = vxl->full_update;
+	const s64 n_shaded0 = stats->n_shaded;
+	const s64 n_rendered0 = stats->n_rendered;
+	s64 faces_ns;
+	stats->n_flushes++;
+	stats->shade_dirty_peak = MAX(stats->shade_dirty_peak, vxl->shade_dirty.n_voxels);
+	stats->render_dirty_peak = MAX(stats->render_dirty_peak, vxl->render_dirty.n_voxels);
+
+	if (full) {
+		s64 trace_t1 = trace_begin();
+		perf_begin(vxl->perf);
+		reset_view(vxl, 1);
+		perf_end(vxl->perf, PERF_QUEUE, (s64)vxl->dim_x * vxl->dim_y * vxl->dim_z);
+		trace_end("reset view", trace_t1);
+
+		// full per-voxel face update
+		const s64 t1 = trace_now_ns();
+		trace_t1 = trace_begin();
+		perf_begin(vxl->perf);
+		#ifdef VXL_SCALAR_SHADE
+		stats->n_shaded += pool_for(vxl, faces_slab_job, NULL, vxl->chunk_dim_z, 1);
+		#else
+		stats->n_shaded += pool_for(vxl, faces_chunk_job, NULL, count_world_chunks(vxl), 16);
+		#endif
+		perf_end(vxl->perf, PERF_FACES, stats->n_shaded - n_shaded0);
+		trace_end("faces", trace_t1);
+		faces_ns = trace_now_ns() - t1;
+
+		trace_t1 = trace_begin();
+		perf_begin(vxl->perf);
+		render_all(vxl);
+		perf_end(vxl->perf, PERF_RENDER, stats->n_rendered - n_rendered0);
+		trace_end("render all", trace_t1);
+
+		vxl->full_update = 0;
+		vxl->full_render = 0;
+		stats->n_full_flushes++;
+
+		#ifdef DEBUG
+		printf("vxl_flush: FULL; %d data blocks, %d face blocks (of %d chunks)\n",
+			count_blocks(vxl, vxl->chunk_data),
+			count_blocks(vxl, vxl->chunk_faces),
+			count_world_chunks(vxl));
+		#endif
+	} else {
+		const int grain = 16;
+
+		s64 trace_t1 = trace_begin();
+		if (vxl->palette_changed && !vxl->full_render) {
+			int n_repainted = pool_for(vxl, repaint_job, NULL, vxl->bitmap_height, grain);
+			clear_palette_dirty(vxl);
+			damage_all(vxl);
+			#ifdef DEBUG
+			printf("vxl_flush: repainted %d\n", n_repainted);
+			#else
+			(void)n_repainted;
+			#endif
+			trace_end("repaint", trace_t1);
+		}
+
+		const s64 t1 = trace_now_ns();
+		trace_t1 = trace_begin();
+		perf_begin(vxl->perf);
+		dirty_sort(&vxl->shade_dirty);
+		perf_end(vxl->perf, PERF_QUEUE, vxl->shade_dirty.n_voxels);
+		perf_begin(vxl->perf);
+		stats->n_shaded += pool_for(vxl, faces_dirty_job, NULL, vxl->shade_dirty.n_chunks, grain);
+		perf_end(vxl->perf, PERF_FACES, stats->n_shaded - n_shaded0);
+		dirty_reset(&vxl->shade_dirty);
+		trace_end("faces", trace_t1);
+		faces_ns = trace_now_ns() - t1;
+
+		// per flush counts are in vxl->stats; printing them here would
+		// cost more than some flushes
+		trace_t1 = trace_begin();
+		if (vxl->full_render) {
+			perf_begin(vxl->perf);
+			reset_view(vxl, 0);
+			perf_end(vxl->perf, PERF_QUEUE, (s64)vxl->dim_x * vxl->dim_y * vxl->dim_z);
+			perf_begin(vxl->perf);
+			render_all(vxl);
+			perf_end(vxl->perf, PERF_RENDER, stats->n_rendered - n_rendered0);
+			vxl->full_render = 0;
+			trace_end("render all", trace_t1);
+		} else {
+			perf_begin(vxl->perf);
+			dirty_sort(&vxl->render_dirty);
+			for (int i = 0; i < vxl->render_dirty.n_chunks; i++) damage_chunk(vxl, vxl->render_dirty.chunks[i]);
+			perf_end(vxl->perf, PERF_QUEUE, vxl->render_dirty.n_voxels);
+			perf_begin(vxl->perf);
+			stats->n_rendered += pool_for(vxl, render_dirty_job, NULL, vxl->render_dirty.n_chunks, grain);
+			perf_end(vxl->perf, PERF_RENDER, stats->n_rendered - n_rendered0);
+			dirty_reset(&vxl->render_dirty);
+			trace_end("render", trace_t1);
+		}
+	}
+
+	stats->faces_ns += faces_ns;
+	stats->render_ns += trace_now_ns() - t0 - faces_ns;
+	trace_end(full ? "vxl_flush full" : "vxl_flush", trace_t0);
+
+	assert(vxl->full_update == 0);
+	assert(vxl->full_render == 0);
+	assert(vxl->shade_dirty.n_voxels == 0);
+	assert(vxl->render_dirty.n_voxels == 0);
+
+	if (vxl->verify_interval > 0 && --vxl->verify_countdown == 0) {
+		verify(vxl);
+		vxl->verify_countdown = vxl->verify_interval;
+	}
+}
+
+void vxl_flush(struct vxl* vxl)
+{
+	if (vxl->record != NULL) record_op(vxl, VXL_OP_FLUSH, NULL, 0, NULL, 0);
+	flush(vxl);
+}
+
+static inline void mark_render(struct vxl* vxl, int x, int y, int z)
+{
+	as_diagonal(
+		-vxl->rotation_vx, -vxl->rotation_vy, 1,
+		vxl->dim_x, vxl->dim_y, vxl->dim_z,
+		&x, &y, &z);
+	dirty_mark(&vxl->render_dirty, vxl_idx(vxl, x, y, z));
+}
+
+// true if [x,y,z] is the voxel its diagonal shows
+static inline int is_hit(struct vxl* vxl, int x, int y, int z)
+{
+	return vxl->depths[voxel_slot(vxl, x, y, z)] == occupancy_depth(vxl, x, y, z);
+}
+
+// queues the render work for a changed voxel at (x,y,z) in the shown view,
+// if any. solid_changed means it may have turned from air to solid or back,
+// so its occupancy bit and its diagonal's depth may need updating, and the
+// neighbours whose camera facing face it covers may show another shade
+static void mark_view(struct vxl* vxl, int x, int y, int z, int solid_changed)
+{
+	const int slot = voxel_slot(vxl, x, y, z);
+	const int depth = occupancy_depth(vxl, x, y, z);
+	const int hit = vxl->depths[slot];
+
+	if (solid_changed) {
+		u64* words = &vxl->occupancy[slot * vxl->occupancy_words];
+		u64 mask = (u64)1 << (depth & 63);
+		const int solid = vxl_get(vxl, x, y, z) != 0;
+		if (solid) {
+			words[depth >> 6] |= mask;
+			if (depth < hit) vxl->depths[slot] = depth;
+		} else {
+			words[depth >> 6] &= ~mask;
+			if (depth == hit) vxl->depths[slot] = first_hit(vxl, words, depth + 1);
+		}
+
+		const int vx = vxl->rotation_vx;
+		const int vy = vxl->rotation_vy;
+		if (vxl_inside(vxl, x+vx, y, z) && is_hit(vxl, x+vx, y, z)) mark_render(vxl, x+vx, y, z);
+		if (vxl_inside(vxl, x, y+vy, z) && is_hit(vxl, x, y+vy, z)) mark_render(vxl, x, y+vy, z);
+		if (vxl_inside(vxl, x, y, z-1) && is_hit(vxl, x, y, z-1)) mark_render(vxl, x, y, z-1);
+	}
+
+	if (vxl->depths[slot] != hit || depth == hit) {
+		mark_render(vxl, x, y, z);
+	} else {
+		vxl->stats.n_occluded++;
+	}
+}
+
+// queues update_faces() for a voxel that turned solid or air, and for its
+// face neighbours. neighbours in the guard band are air, so updating them is
+// a no-op, but cheaper than checking bounds for every voxel
+static void mark_faces(struct vxl* vxl, int x, int y, int z)
+{
+	static const int n[7][3] = {
+		{0,0,0}, {-1,0,0}, {1,0,0}, {0,-1,0}, {0,1,0}, {0,0,-1}, {0,0,1}
+	};
+	for (int i = 0; i < 7; i++) {
+		dirty_mark(&vxl->shade_dirty, vxl_idx(vxl, x + n[i][0], y + n[i][1], z + n[i][2]));
+	}
+}
+
+// puts aren't tracked in "full update" mode, so hidden views can't catch up
+static void stale_hidden_views(struct vxl* vxl)
+{
+	for (int i = 0; i < vxl->n_views; i++) {
+		if (i == shown_view_index(vxl)) continue;
+		struct vxl_view* view = &vxl->views[i];
+		if (view->stale) continue;
+		view->stale = 1;
+		dirty_clear(&view->changed);
+	}
+}
+
+void vxl_put(struct vxl* vxl, int x, int y, int z, u8 v)
+{
+	if (!vxl_inside(vxl, x, y, z)) return;
+	if (vxl->record != NULL) record_put(vxl, x, y, z, v);
+	vxl->stats.n_put++;
+	int idx = vxl_idx(vxl, x, y, z);
+	int chunk_index = idx >> CHUNK_VOLUME_LOG2;
+	int local_index = idx & (CHUNK_VOLUME-1);
+
+	u8 p = vxl->chunk_data[chunk_index][local_index];
+	if (p != v) own_block(vxl, vxl->chunk_data, chunk_index)[local_index] = v;
+
+	const int solid_changed = (p == 0) != (v == 0);
+	if (solid_changed) {
+		int n = vxl->chunk_solid[chunk_index] += v ? 1 : -1;
+		if (n == 0) {
+			release_block(vxl, vxl->chunk_data, chunk_index, 0);
+			release_block(vxl, vxl->chunk_faces, chunk_index, 0);
+		} else if (n == CHUNK_VOLUME) {
+			compact_block(vxl, vxl->chunk_data, chunk_index);
+		}
+	}
+
+	if (vxl->full_update && p != v) {
+		stale_hidden_views(vxl);
+		if (solid_changed && occupancy_sync(vxl, 1)) occupancy_update(vxl, x, y, z);
+	}
+
+	if (vxl->full_update || p == v) {
+		// if in "full update" mode, or if the put is a no-op, bail
+		// early because the rest deals with face/render dirty sets
+		return;
+	}
+
+	if (solid_changed) mark_faces(vxl, x, y, z);
+
+	// the whole view is rendered anyway
+	if (!vxl->full_render) mark_view(vxl, x, y, z, solid_changed);
+
+	// hidden views catch up when shown; see VIEWS
+	for (int i = 0; i < vxl->n_views; i++) {
+		struct vxl_view* view = &vxl->views[i];
+		if (i == shown_view_index(vxl) || view->stale) continue;
+		dirty_mark(&view->changed, idx);
+	}
+}
+
+/*
+
+BOX EDITS
+
+vxl_fill_box(), vxl_put_span() and vxl_put_column() are edit_box() with
+different value strides. edit_box() writes chunk by chunk (whole chunk
+fills just share a uniform block), and then invalidates the bounding box of
+the voxels that changed in one go, instead of per voxel like vxl_put():
+faces in the box and of its face neighbours are marked a chunk row at a
+time, and every diagonal through the box (grown by one towards the
+neighbours whose shade it may change) gets its depth searched again and is
+queued if what it shows may have changed. faces_dirty_job() runs chunks
+that end up wholly marked through the faces kernel.
+
+*/
+
+// [x0;x1) × [y0;y1) × [z0;z1)
+struct box {
+	int x0, y0, z0;
+	int x1, y1, z1;
+};
+
+static inline int box_contains(const struct box* b, int x, int y, int z)
+{
+	return x >= b->x0 && y >= b->y0 && z >= b->z0 && x < b->x1 && y < b->y1 && z < b->z1;
+}
+
+static inline void box_grow(struct box* b, int x0, int y0, int z0, int x1, int y1, int z1)
+{
+	b->x0 = MIN(b->x0, x0);
+	b->y0 = MIN(b->y0, y0);
+	b->z0 = MIN(b->z0, z0);
+	b->x1 = MAX(b->x1, x1);
+	b->y1 = MAX(b->y1, y1);
+	b->z1 = MAX(b->z1, z1);
+}
+
+// searches the depth of the diagonal through [x,y,z] again, and queues it
+// if the depth changed or if it hits inside b
+static inline void retrace(struct vxl* vxl, const struct box* b, int x, int y, int z)
+{
+	const int vx = vxl->rotation_vx;
+	const int vy = vxl->rotation_vy;
+	const int slot = voxel_slot(vxl, x, y, z);
+	const int hit = vxl->depths[slot];
+	const int depth = first_hit(vxl, &vxl->occupancy[slot * vxl->occupancy_words], 0);
+	vxl->depths[slot] = depth;
+
+	as_diagonal(-vx, -vy, 1, vxl->dim_x, vxl->dim_y, vxl->dim_z, &x, &y, &z);
+	if (depth != hit || (depth != NO_HIT && box_contains(b, x + depth*vx, y + depth*vy, z - depth))) {
+		dirty_mark(&vxl->render_dirty, vxl_idx(vxl, x, y, z));
+	} else {
+		vxl->stats.n_occluded++;
+	}
+}
+
+static void occupancy_box(struct vxl* vxl, struct box b)
+{
+	for (int z = b.z0; z < b.z1; z++) {
+		for (int y = b.y0; y < b.y1; y++) {
+			for (int x = b.x0; x < b.x1; x++) {
+				occupancy_update(vxl, x, y, z);
+			}
+		}
+	}
+}
+
+// box version of mark_view()
+static void view_box(struct vxl* vxl, struct box b, int solid_changed)
+{
+	const int vx = vxl->rotation_vx;
+	const int vy = vxl->rotation_vy;
+
+	// the diagonals through the box (see below) outnumber the voxels of
+	// thin boxes, like columns and spans, so mark those voxel by voxel
+	const int w = b.x1 - b.x0;
+	const int h = b.y1 - b.y0;
+	const int d = b.z1 - b.z0;
+	if (w*h*d <= (w+1)*(h+1) + d*(w+h+1)) {
+		for (int z = b.z0; z < b.z1; z++) {
+			for (int y = b.y0; y < b.y1; y++) {
+				for (int x = b.x0; x < b.x1; x++) {
+					mark_view(vxl, x, y, z, solid_changed);
+				}
+			}
+		}
+		return;
+	}
+
+	if (solid_changed) {
+		occupancy_box(vxl, b);
+
+		// neighbours whose camera facing face the box covers; see
+		// mark_view()
+		if (vx > 0) b.x1 = MIN(b.x1 + 1, vxl->dim_x); else b.x0 = MAX(b.x0 - 1, 0);
+		if (vy > 0) b.y1 = MIN(b.y1 + 1, vxl->dim_y); else b.y0 = MAX(b.y0 - 1, 0);
+		b.z0 = MAX(b.z0 - 1, 0);
+	}
+
+	// every diagonal through the box enters it through its top or its
+	// camera facing X or Y side
+	const int xfront = vx > 0 ? b.x0 : b.x1-1;
+	const int yfront = vy > 0 ? b.y0 : b.y1-1;
+	for (int y = b.y0; y < b.y1; y++) {
+		for (int x = b.x0; x < b.x1; x++) {
+			retrace(vxl, &b, x, y, b.z1-1);
+		}
+	}
+	for (int z = b.z0; z < b.z1-1; z++) {
+		for (int x = b.x0; x < b.x1; x++) {
+			retrace(vxl, &b, x, yfront, z);
+		}
+		for (int y = b.y0; y < b.y1; y++) {
+			if (y == yfront) continue;
+			retrace(vxl, &b, xfront, y, z);
+		}
+	}
+}
+
+// writes values[(x-x0)*sx + (y-y0)*sy + (z-z0)*sz] to the voxels [x,y,z] of
+// b that are inside the world
+static void edit_box(struct vxl* vxl, struct box b, const u8* values, int sx, int sy, int sz)
+{
+	if (b.x0 < 0) { values -= b.x0 * sx; b.x0 = 0; }
+	if (b.y0 < 0) { values -= b.y0 * sy; b.y0 = 0; }
+	if (b.z0 < 0) { values -= b.z0 * sz; b.z0 = 0; }
+	b.x1 = MIN(b.x1, vxl->dim_x);
+	b.y1 = MIN(b.y1, vxl->dim_y);
+	b.z1 = MIN(b.z1, vxl->dim_z);
+	if (b.x0 >= b.x1 || b.y0 >= b.y1 || b.z0 >= b.z1) return;
+	vxl->stats.n_put += (s64)(b.x1 - b.x0) * (b.y1 - b.y0) * (b.z1 - b.z0);
+
+	const int fill = sx == 0 && sy == 0 && sz == 0;
+
+	// bounding box of the changed voxels
+	struct box c = {INT_MAX, INT_MAX, INT_MAX, INT_MIN, INT_MIN, INT_MIN};
+	int solid_changed = 0;
+
+	for (int cz = b.z0 >> CHUNK_LENGTH_LOG2; cz <= (b.z1-1) >> CHUNK_LENGTH_LOG2; cz++) {
+		const int oz = cz * CHUNK_LENGTH;
+		const int lz0 = MAX(b.z0 - oz, 0);
+		const int lz1 = MIN(b.z1 - oz, CHUNK_LENGTH);
+		for (int cy = b.y0 >> CHUNK_LENGTH_LOG2; cy <= (b.y1-1) >> CHUNK_LENGTH_LOG2; cy++) {
+			const int oy = cy * CHUNK_LENGTH;
+			const int ly0 = MAX(b.y0 - oy, 0);
+			const int ly1 = MIN(b.y1 - oy, CHUNK_LENGTH);
+			for (int cx = b.x0 >> CHUNK_LENGTH_LOG2; cx <= (b.x1-1) >> CHUNK_LENGTH_LOG2; cx++) {
+				const int ox = cx * CHUNK_LENGTH;
+				const int lx0 = MAX(b.x0 - ox, 0);
+				const int lx1 = MIN(b.x1 - ox, CHUNK_LENGTH);
+				const int chunk_index = vxl_chunk_idx(vxl, cx, cy, cz);
+
+				const int whole = lx0 == 0 && ly0 == 0 && lz0 == 0
+					&& lx1 == CHUNK_LENGTH && ly1 == CHUNK_LENGTH && lz1 == CHUNK_LENGTH;
+				if (fill && whole) {
+					const u8 v = values[0];
+					const u8* p = vxl->chunk_data[chunk_index];
+					if (is_uniform_block(vxl, p) && p[0] == v) continue;
+					const int n = v ? CHUNK_VOLUME : 0;
+					solid_changed |= vxl->chunk_solid[chunk_index] != n;
+					vxl->chunk_solid[chunk_index] = n;
+					release_block(vxl, vxl->chunk_data, chunk_index, v);
+					if (n == 0) release_block(vxl, vxl->chunk_faces, chunk_index, 0);
+					box_grow(&c, ox, oy, oz, ox + CHUNK_LENGTH, oy + CHUNK_LENGTH, oz + CHUNK_LENGTH);
+					continue;
+				}
+
+				u8* block = vxl->chunk_data[chunk_index];
+
+				// rewrites typically leave most of what they cover as
+				// it was, so look for a difference before doing the
+				// bookkeeping. a column gets a loop of its own since
+				// the one below would run its inner loops once per voxel
+				int diff = 0;
+				if (lx1 - lx0 == 1 && ly1 - ly0 == 1) {
+					const int column = (ox + lx0 - b.x0)*sx + (oy + ly0 - b.y0)*sy + (oz - b.z0)*sz;
+					for (int lz = lz0; lz < lz1; lz++) {
+						diff |= values[column + lz*sz] ^ block[vxl_local_idx(vxl, lx0, ly0, lz)];
+					}
+				} else {
+					for (int lz = lz0; lz < lz1; lz++) {
+						for (int ly = ly0; ly < ly1; ly++) {
+							const int row = (ox - b.x0)*sx + (oy + ly - b.y0)*sy + (oz + lz - b.z0)*sz;
+							for (int lx = lx0; lx < lx1; lx++) {
+								diff |= values[row + lx*sx] ^ block[vxl_local_idx(vxl, lx, ly, lz)];
+							}
+						}
+					}
+				}
+				if (!diff) continue;
+
+				block = own_block(vxl, vxl->chunk_data, chunk_index);
+				int n = vxl->chunk_solid[chunk_index];
+				for (int lz = lz0; lz < lz1; lz++) {
+					for (int ly = ly0; ly < ly1; ly++) {
+						const int row = (ox - b.x0)*sx + (oy + ly - b.y0)*sy + (oz + lz - b.z0)*sz;
+						for (int lx = lx0; lx < lx1; lx++) {
+							const int local_index = vxl_local_idx(vxl, lx, ly, lz);
+							const u8 v = values[row + lx*sx];
+							const u8 p = block[local_index];
+							if (p == v) continue;
+							block[local_index] = v;
+							if ((p == 0) != (v == 0)) {
+								n += v ? 1 : -1;
+								solid_changed = 1;
+							}
+							box_grow(&c, ox+lx, oy+ly, oz+lz, ox+lx+1, oy+ly+1, oz+lz+1);
+						}
+					}
+				}
+				vxl->chunk_solid[chunk_index] = n;
+				if (n == 0) {
+					release_block(vxl, vxl->chunk_data, chunk_index, 0);
+					release_block(vxl, vxl->chunk_faces, chunk_index, 0);
+				} else if (n == CHUNK_VOLUME) {
+					compact_block(vxl, vxl->chunk_data, chunk_index);
+				}
+			}
+		}
+	}
+
+	if (c.x0 >= c.x1) return; // no-op
+
+	if (vxl->full_update) {
+		stale_hidden_views(vxl);
+		const int volume = (c.x1 - c.x0) * (c.y1 - c.y0) * (c.z1 - c.z0);
+		if (solid_changed && occupancy_sync(vxl, volume)) occupancy_box(vxl, c);
+		return;
+	}
+
+	if (solid_changed) {
+		// the box and its face neighbours, like mark_faces()
+		dirty_mark_box(vxl, &vxl->shade_dirty, c.x0-1, c.y0, c.z0, c.x1+1, c.y1, c.z1);
+		dirty_mark_box(vxl, &vxl->shade_dirty, c.x0, c.y0-1, c.z0, c.x1, c.y1+1, c.z1);
+		dirty_mark_box(vxl, &vxl->shade_dirty, c.x0, c.y0, c.z0-1, c.x1, c.y1, c.z1+1);
+	}
+
+	if (!vxl->full_render) view_box(vxl, c, solid_changed);
+
+	for (int i = 0; i < vxl->n_views; i++) {
+		struct vxl_view* view = &vxl->views[i];
+		if (i == shown_view_index(vxl) || view->stale) continue;
+		dirty_mark_box(vxl, &view->changed, c.x0, c.y0, c.z0, c.x1, c.y1, c.z1);
+	}
+}
+
+void vxl_fill_box(struct vxl* vxl, int x0, int y0, int z0, int x1, int y1, int z1, u8 v)
+{
+	if (vxl->record != NULL) {
+		const s32 args[] = {x0, y0, z0, x1, y1, z1};
+		record_op(vxl, VXL_OP_FILL_BOX, args, 6, &v, 1);
+	}
+	struct box b = {x0, y0, z0, x1, y1, z1};
+	edit_box(vxl, b, &v, 0, 0, 0);
+}
+
+void vxl_put_span(struct vxl* vxl, int x, int y, int z, int n, const u8* values)
+{
+	if (vxl->record != NULL) {
+		const s32 args[] = {x, y, z, n};
+		record_op(vxl, VXL_OP_PUT_SPAN, args, 4, values, MAX(n, 0));
+	}
+	struct box b = {x, y, z, x+n, y+1, z+1};
+	edit_box(vxl, b, values, 1, 0, 0);
+}
+
+void vxl_put_column(struct vxl* vxl, int x, int y, int z, int n, const u8* values)
+{
+	if (vxl->record != NULL) {
+		const s32 args[] = {x, y, z, n};
+		record_op(vxl, VXL_OP_PUT_COLUMN, args, 4, values, MAX(n, 0));
+	}
+	struct box b = {x, y, z, x+1, y+1, z+n};
+	edit_box(vxl, b, values, 0, 0, 1);
+}
+
+// flushes pending work before a mode change
+static void forced_flush(struct vxl* vxl)
+{
+	const s64 trace_t0 = trace_begin();
+	vxl->stats.n_forced_flushes++;
+	flush(vxl);
+	trace_end("forced flush", trace_t0);
+}
+
+void vxl_set_full_update(struct vxl* vxl)
+{
+	if (vxl->record != NULL) record_op(vxl, VXL_OP_FULL_UPDATE, NULL, 0, NULL, 0);
+	if (vxl->full_update) return;
+	forced_flush(vxl);
+	vxl->full_update = 1;
+}
+
+static void mark_changed(struct vxl* vxl, int x, int y, int z)
+{
+	mark_view(vxl, x, y, z, 1);
+}
+
+void vxl_set_rotation(struct vxl* vxl, int rotation)
+{
+	if (vxl->record != NULL) {
+		const s32 args[] = {rotation};
+		record_op(vxl, VXL_OP_ROTATION, args, 1, NULL, 0);
+	}
+	rotation = rotation & 3;
+	if (rotation == vxl->rotation) return;
+
+	if (!(vxl->flags & VXL_CACHE_ROTATIONS)) {
+		// flush pending changes before the view vectors change; they
+		// were queued for the old rotation. faces don't depend on the
+		// rotation, so only rendering starts over
+		if (!vxl->full_update && !vxl->full_render) forced_flush(vxl);
+		vxl->rotation = rotation;
+		rotation_vector(rotation, &vxl->rotation_vx, &vxl->rotation_vy);
+		update_face_shade(vxl);
+		vxl->occupancy_stale = 1;
+		if (!vxl->full_update) vxl->full_render = 1;
+		return;
+	}
+
+	// finish the shown view before parking it
+	forced_flush(vxl);
+	save_view(vxl, &vxl->views[vxl->rotation]);
+	load_view(vxl, &vxl->views[rotation]);
+	update_face_shade(vxl);
+
+	struct vxl_view* view = &vxl->views[rotation];
+	if (view->stale) {
+		vxl->occupancy_stale = 1;
+		vxl->full_render = 1;
+	} else {
+		// replay the puts the view missed; the next vxl_flush() does
+		// the work
+		dirty_sort(&view->changed);
+		dirty_walk(vxl, &view->changed, mark_changed, 0, view->changed.n_chunks);
+		dirty_reset(&view->changed);
+		damage_all(vxl);
+	}
+	view->stale = 0;
+}
+
+void vxl_record(struct vxl* vxl, FILE* f)
+{
+	vxl->record = f;
+	if (f == NULL) return;
+
+	const s32 init[] = {vxl->dim_x, vxl->dim_y, vxl->dim_z, vxl->flags};
+	record_op(vxl, VXL_OP_INIT, init, 4, NULL, 0);
+	record_palette(vxl, vxl->palette);
+	const s32 rotation[] = {vxl->rotation};
+	record_op(vxl, VXL_OP_ROTATION, rotation, 1, NULL, 0);
+
+	// the voxels, as a full update of the rows that have any
+	record_op(vxl, VXL_OP_FULL_UPDATE, NULL, 0, NULL, 0);
+	u8* row;
+	assert((row = malloc(vxl->dim_x)) != NULL);
+	for (int z = 0; z < vxl->dim_z; z++) {
+		for (int y = 0; y < vxl->dim_y; y++) {
+			int any = 0;
+			for (int x = 0; x < vxl->dim_x; x++) any |= row[x] = vxl_get(vxl, x, y, z);
+			if (!any) continue;
+			const s32 args[] = {0, y, z, vxl->dim_x};
+			record_op(vxl, VXL_OP_PUT_SPAN, args, 4, row, vxl->dim_x);
+		}
+	}
+	free(row);
+	record_op(vxl, VXL_OP_SETUP, NULL, 0, NULL, 0);
+}
+
+size_t vxl_memory_usage(struct vxl* vxl)
+{
+	size_t n = 256 << CHUNK_VOLUME_LOG2;
+	n += vxl->n_chunks * (sizeof *vxl->chunk_data + sizeof *vxl->chunk_faces + sizeof *vxl->chunk_solid);
+	n += (size_t)count_blocks(vxl, vxl->chunk_data) << CHUNK_VOLUME_LOG2;
+	n += (size_t)count_blocks(vxl, vxl->chunk_faces) << CHUNK_VOLUME_LOG2;
+	n += 256 * N_SHADES * 2 * sizeof *vxl->colors;
+
+	const size_t dirty_size = vxl->n_chunks * (CHUNK_WORDS * sizeof(u64) + 1 + sizeof(int));
+	n += 2 * dirty_size;
+
+	for (int i = 0; i < vxl->n_views; i++) {
+		n += vxl->occupancy_size * sizeof *vxl->occupancy;
+		n += vxl->bitmap_width * vxl->bitmap_height * sizeof *vxl->bitmap;
+		n += vxl->bitmap_height * vxl->occupancy_row * (sizeof *vxl->hits + sizeof *vxl->depths);
+		if (vxl->flags & VXL_CACHE_ROTATIONS) n += dirty_size;
+	}
+	if (vxl->verify_bitmap != NULL) n += vxl->bitmap_width * vxl->bitmap_height * sizeof *vxl->verify_bitmap;
+	return n;
 }
@@ -1,13 +1,99 @@
 #ifndef VXL_H
 
+#include <stdio.h>
 #include <stdint.h>
 
 #include "common.h"
 
+// chunk size and the order of the voxels in a chunk are compile time
+// options: -DCHUNK_LENGTH_LOG2=4 gives 16³ chunks, and -DVXL_MORTON orders
+// the voxels of a chunk along a Z-order (Morton) curve instead of along X,
+// then Y, then Z. "make bench_layouts" compares them
+#ifndef CHUNK_LENGTH_LOG2
 #define CHUNK_LENGTH_LOG2 (3)
+#endif
+// dirty sets need 64 voxels per chunk at least, and chunk_solid is a u16
+#if CHUNK_LENGTH_LOG2 < 2 || CHUNK_LENGTH_LOG2 > 5
+#error "CHUNK_LENGTH_LOG2 must be in [2;5]"
+#endif
 #define CHUNK_LENGTH (1 << CHUNK_LENGTH_LOG2)
 #define CHUNK_LENGTH_MASK (CHUNK_LENGTH - 1)
 
+#define CHUNK_VOLUME_LOG2 (3*CHUNK_LENGTH_LOG2)
+#define CHUNK_VOLUME (1 << CHUNK_VOLUME_LOG2)
+#define CHUNK_WORDS (CHUNK_VOLUME / 64)
+
+// counters accumulated by vxl_flush() and vxl_put(); never reset by the
+// engine, so clear them yourself (memset) before measuring something
+struct vxl_stats {
+	int n_flushes;
+	int n_full_flushes;
+	// flushes vxl_set_rotation() and vxl_set_full_update() ran before
+	// changing modes
+	int n_forced_flushes;
+	// voxels written by vxl_put() and box edits (whether they changed or
+	// not); box edits count the part of the box inside the world
+	s64 n_put;
+	s64 n_shaded;
+	s64 n_rendered;
+	// puts behind the visible surface, which needn't render anything
+	s64 n_occluded;
+	int shade_dirty_peak;
+	int render_dirty_peak;
+	// time vxl_flush() spent updating faces, and everything else
+	// (occupancy, rendering, repainting)
+	s64 faces_ns;
+	s64 render_ns;
+	// shadow verifications run, and the bitmap pixels they found wrong;
+	// see vxl_set_verify()
+	int n_verified;
+	s64 n_verify_mismatches;
+};
+
+// set of voxels; one bit per voxel indexed by vxl_idx(), and a list of chunks that have at least one bit set
+struct vxl_dirty {
+	u64* bits;
+	u8* chunk_flags;
+	int* chunks;
+	int n_chunks;
+	int n_voxels;
+};
+
+struct vxl_pool;
+struct perf;
+
+// bitmap rectangle [x0;x1) × [y0;y1)
+struct vxl_rect {
+	int x0, y0;
+	int x1, y1;
+};
+
+#define VXL_MAX_DAMAGE (16)
+
+// vxl_init() flags
+// keep all four rotations rendered so vxl_set_rotation() needn't re-render
+// everything; see VIEWS in vxl.c
+#define VXL_CACHE_ROTATIONS (1<<0)
+
+// the rotation dependent state; the shown view's lives in struct vxl, the
+// others in vxl->views
+struct vxl_view {
+	int rotation;
+	int rotation_vx;
+	int rotation_vy;
+	u64* occupancy;
+	u32* bitmap;
+	u16* hits;
+	u16* depths;
+	u8 palette_dirty[256];
+	int palette_changed;
+
+	// voxels put while the view was hidden
+	struct vxl_dirty changed;
+	// hidden view needs a full update when shown
+	int stale;
+};
+
 struct vxl {
 	int dim_x;
 	int dim_y;
@@ -15,36 +101,133 @@ struct vxl {
 	int chunk_dim_x;
 	int chunk_dim_y;
 	int chunk_dim_z;
-	int cdxy;
+	// the chunk tables have a guard band of one air chunk around the
+	// world, so that chunk (and voxel) neighbours of the world are valid
+	// indices; see vxl_chunk_idx(). n_chunks includes the guard chunks
+	int chunk_stride_y;
+	int chunk_stride_z;
+	int chunk_origin;
+	int n_chunks;
+
+	int flags;
 
-	u8* data;
-	u8* shade;
+	// voxel values and exposed faces (see FACES in vxl.c),
+	// CHUNK_VOLUME bytes per chunk indexed by vxl_local_idx(). chunks that
+	// are all one value point at a shared uniform block instead of owning
+	// one; see CHUNK STORAGE in vxl.c
+	u8** chunk_data;
+	u8** chunk_faces;
+	u8* uniform;
 
-	int shade_queue_len, shade_queue_cap;
-	union ivec3* shade_queue;
+	// number of non-zero voxels in each chunk; see vxl_chunk_state()
+	u16* chunk_solid;
 
-	int render_queue_len, render_queue_cap;
-	union ivec3* render_queue;
+	// solid bits per view diagonal; see OCCUPANCY in vxl.c
+	int occupancy_row;
+	int occupancy_words;
+	size_t occupancy_size;
+	u64* occupancy;
+	// set when occupancy doesn't match chunk_data, so the next full update
+	// or full render rebuilds it
+	int occupancy_stale;
+	// voxels synced into occupancy in "full update" mode since the last
+	// flush; see OCCUPANCY in vxl.c
+	int occupancy_synced;
+
+	// voxels whose exposed faces to update
+	struct vxl_dirty shade_dirty;
+	// diagonals to rerender, keyed by their first voxel (see as_diagonal())
+	struct vxl_dirty render_dirty;
 
 	int bitmap_width;
 	int bitmap_height;
 	u32* bitmap;
 
+	// rgba per material (voxel value); see vxl_set_palette()
+	u32 palette[256];
+	// palette colours per material and shade; see PALETTE in vxl.c
+	u32* colors;
+	// material and shade shown by each fat pixel, keyed like occupancy
+	u16* hits;
+	// steps from the start of each diagonal to its first solid voxel, or
+	// 0xffff if it has none; keyed like occupancy. see OCCUPANCY in vxl.c
+	u16* depths;
+	// bitmap rectangles changed by vxl_flush() since the last
+	// vxl_clear_damage(); they may overlap and cover more than what
+	// actually changed
+	struct vxl_rect damage[VXL_MAX_DAMAGE];
+	int n_damage;
+
+	// materials whose fat pixels need repainting
+	u8 palette_dirty[256];
+	int palette_changed;
+
 	int rotation;
 	int rotation_vx;
 	int rotation_vy;
+	// shade per face mask for this rotation
+	u8 face_shade[64];
 
 	int full_update;
+	// the next vxl_flush() renders everything, but doesn't update faces
+	// that didn't change
+	int full_render;
+
+	int n_threads;
+	struct vxl_pool* pool;
+
+	// VXL_CACHE_ROTATIONS: view per rotation; otherwise only views[0]
+	struct vxl_view views[4];
+	int n_views;
+
+	struct vxl_stats stats;
+	// hardware counters per vxl_flush() phase, if set; see perf.h
+	struct perf* perf;
+	// see vxl_record()
+	FILE* record;
+	// see vxl_set_verify()
+	int verify_interval;
+	int verify_countdown;
+	u32* verify_bitmap;
 };
 
+// valid for chunks in the world and in the guard band, i.e. for cx in
+// [-1;chunk_dim_x] etc.
 static inline int vxl_chunk_idx(struct vxl* vxl, int cx, int cy, int cz)
 {
-	return (cx) + (cy * vxl->chunk_dim_x) + (cz * vxl->cdxy);
+	return vxl->chunk_origin + (cx) + (cy * vxl->chunk_stride_y) + (cz * vxl->chunk_stride_z);
 }
 
+#ifdef VXL_MORTON
+// moves bit i of v to bit 3i (for v < 1024)
+static inline int vxl_morton_spread(int v)
+{
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8))  & 0x0300f00f;
+	v = (v | (v << 4))  & 0x030c30c3;
+	v = (v | (v << 2))  & 0x09249249;
+	return v;
+}
+
+// inverse of vxl_morton_spread(); ignores the bits in between
+static inline int vxl_morton_compact(int v)
+{
+	v &= 0x09249249;
+	v = (v ^ (v >> 2))  & 0x030c30c3;
+	v = (v ^ (v >> 4))  & 0x0300f00f;
+	v = (v ^ (v >> 8))  & 0x030000ff;
+	v = (v ^ (v >> 16)) & 0x000003ff;
+	return v;
+}
+#endif
+
 static inline int vxl_local_idx(struct vxl* vxl, int x, int y, int z)
 {
+	#ifdef VXL_MORTON
+	return vxl_morton_spread(x) | (vxl_morton_spread(y) << 1) | (vxl_morton_spread(z) << 2);
+	#else
 	return (x) + (y << CHUNK_LENGTH_LOG2) + (z << (2*CHUNK_LENGTH_LOG2));
+	#endif
 }
 
 static inline int vxl_idx(struct vxl* vxl, int x, int y, int z)
@@ -59,7 +242,56 @@ static inline int vxl_idx(struct vxl* vxl, int x, int y, int z)
 	int local_z = z & CHUNK_LENGTH_MASK;
 	int local_index = vxl_local_idx(vxl, local_x, local_y, local_z);
 
-	return local_index + (chunk_index << (3*CHUNK_LENGTH_LOG2));
+	return local_index + (chunk_index << CHUNK_VOLUME_LOG2);
+}
+
+static inline u8 vxl_data(struct vxl* vxl, int idx)
+{
+	return vxl->chunk_data[idx >> CHUNK_VOLUME_LOG2][idx & (CHUNK_VOLUME-1)];
+}
+
+static inline u8 vxl_faces(struct vxl* vxl, int idx)
+{
+	return vxl->chunk_faces[idx >> CHUNK_VOLUME_LOG2][idx & (CHUNK_VOLUME-1)];
+}
+
+static inline u8 vxl_get(struct vxl* vxl, int x, int y, int z)
+{
+	return vxl_data(vxl, vxl_idx(vxl, x, y, z));
+}
+
+// inverse of vxl_chunk_idx()
+static inline void vxl_chunk_xyz(struct vxl* vxl, int chunk_index, int* cx, int* cy, int* cz)
+{
+	// the guard band is at -1
+	*cz = chunk_index / vxl->chunk_stride_z - 1;
+	chunk_index %= vxl->chunk_stride_z;
+	*cy = chunk_index / vxl->chunk_stride_y - 1;
+	*cx = chunk_index % vxl->chunk_stride_y - 1;
+}
+
+// inverse of vxl_local_idx()
+static inline void vxl_local_xyz(struct vxl* vxl, int local_index, int* x, int* y, int* z)
+{
+	#ifdef VXL_MORTON
+	*x = vxl_morton_compact(local_index);
+	*y = vxl_morton_compact(local_index >> 1);
+	*z = vxl_morton_compact(local_index >> 2);
+	#else
+	*x = local_index & CHUNK_LENGTH_MASK;
+	*y = (local_index >> CHUNK_LENGTH_LOG2) & CHUNK_LENGTH_MASK;
+	*z = local_index >> (2*CHUNK_LENGTH_LOG2);
+	#endif
+}
+
+#define VXL_CHUNK_EMPTY (0)
+#define VXL_CHUNK_MIXED (1)
+#define VXL_CHUNK_FULL  (2)
+
+static inline int vxl_chunk_state(struct vxl* vxl, int chunk_index)
+{
+	int n = vxl->chunk_solid[chunk_index];
+	return n == 0 ? VXL_CHUNK_EMPTY : n == CHUNK_VOLUME ? VXL_CHUNK_FULL : VXL_CHUNK_MIXED;
 }
 
 static inline int vxl_inside(struct vxl* vxl, int x, int y, int z)
@@ -77,44 +309,93 @@ static inline int vxl_chkidx(struct vxl* vxl, int x, int y, int z)
 }
 
 void vxl_flush(struct vxl* vxl);
-int vxl_put(struct vxl* vxl, int x, int y, int z, uint8_t v);
+void vxl_put(struct vxl* vxl, int x, int y, int z, uint8_t v);
+
+// bulk versions of vxl_put(); much cheaper per voxel, since they write
+// chunk by chunk and queue face/render work for the changed region at once.
+// voxels outside the world are skipped like with vxl_put().
+// fills [x0;x1) × [y0;y1) × [z0;z1) with v
+void vxl_fill_box(struct vxl* vxl, int x0, int y0, int z0, int x1, int y1, int z1, uint8_t v);
+// writes values[0..n-1] to [x..x+n-1,y,z]
+void vxl_put_span(struct vxl* vxl, int x, int y, int z, int n, const uint8_t* values);
+// writes values[0..n-1] to [x,y,z..z+n-1]
+void vxl_put_column(struct vxl* vxl, int x, int y, int z, int n, const uint8_t* values);
+
+void vxl_init(struct vxl* vxl, int dim_x, int dim_y, int dim_z, int flags);
+void vxl_free(struct vxl* vxl);
+
+/*
+
+RECORDINGS
+
+vxl_record() starts appending the calls that change the world or the view
+to a file, which "replay" (replay.c) runs again headless with a timing per
+vxl_flush(). A recording is a sequence of ops, each a byte followed by
+little-endian arguments:
+
+  VXL_OP_INIT         s32 dim_x, dim_y, dim_z, flags; vxl_init()
+  VXL_OP_PALETTE      256 × u32; vxl_set_palette()
+  VXL_OP_ROTATION     s32 rotation
+  VXL_OP_FULL_UPDATE  vxl_set_full_update()
+  VXL_OP_FLUSH        vxl_flush()
+  VXL_OP_SETUP        vxl_flush() ending what vxl_record() wrote; not timed
+  VXL_OP_PUT          u16 x, y, z; u8 v
+  VXL_OP_FILL_BOX     s32 x0, y0, z0, x1, y1, z1; u8 v
+  VXL_OP_PUT_SPAN     s32 x, y, z, n; n × u8
+  VXL_OP_PUT_COLUMN   s32 x, y, z, n; n × u8
+
+*/
+
+#define VXL_OP_INIT        ('I')
+#define VXL_OP_PALETTE     ('P')
+#define VXL_OP_ROTATION    ('R')
+#define VXL_OP_FULL_UPDATE ('U')
+#define VXL_OP_FLUSH       ('F')
+#define VXL_OP_SETUP       ('S')
+#define VXL_OP_PUT         ('p')
+#define VXL_OP_FILL_BOX    ('b')
+#define VXL_OP_PUT_SPAN    ('s')
+#define VXL_OP_PUT_COLUMN  ('c')
 
-void vxl_init(struct vxl* vxl, int dim_x, int dim_y, int dim_z);
+// records calls to f from now on (or stops, for NULL), starting with the
+// dimensions, flags, palette, rotation and voxels as they are, so the
+// recording replays from an empty vxl. f stays the caller's to close
+void vxl_record(struct vxl* vxl, FILE* f);
+
+// bytes allocated by the engine, including chunk blocks and all views
+size_t vxl_memory_usage(struct vxl* vxl);
+
+// number of threads vxl_flush() uses, including the calling thread; <=0
+// means one per online CPU, which is also what vxl_init() sets up
+void vxl_set_threads(struct vxl* vxl, int n_threads);
+
+// every interval'th vxl_flush() from now on (none for 0) checks the
+// bitmap against a render from scratch, counting the pixels that differ in
+// vxl->stats and printing the first diagonals that do to stderr; see
+// SHADOW VERIFICATION in vxl.c
+void vxl_set_verify(struct vxl* vxl, int interval);
 
 // sets "full update mode" which lasts until the next vxl_flush() call, which
-// will shade/render everything, not only voxels affected since last flush
-// (which may happen implicitly/automatically when using vxl_put()). NOTE that
-// direct manipulation of the vxl->data array (e.g. with the help of vxl_idx())
-// is OK when in "full update" mode, whereas vxl_put() is recommended othewise.
-static inline void vxl_set_full_update(struct vxl* vxl)
+// will shade/render everything, not only voxels affected since last flush.
+// vxl_put() is cheap in "full update" mode since it only writes the voxel;
+// write voxels through it, not through vxl->chunk_data, whose blocks may be
+// shared between chunks.
+void vxl_set_full_update(struct vxl* vxl);
+
+// call when vxl->damage has been presented
+static inline void vxl_clear_damage(struct vxl* vxl)
 {
-	if (vxl->full_update) return;
-	vxl_flush(vxl);
-	vxl->full_update = 1;
+	vxl->n_damage = 0;
 }
 
-static inline void vxl_set_rotation(struct vxl* vxl, int rotation)
-{
-	rotation = rotation & 3;
-
-	// calculate view x/y from rotation
-	{
-		int vx = -1;
-		int vy = -1;
-		for (int i = 0; i < rotation; i++) {
-			int tmp = vx;
-			vx = vy;
-			vy = -tmp;
-		}
-		vxl->rotation_vx = vx;
-		vxl->rotation_vy = vy;
-	}
+// sets the rgba colours of materials 1-255 (palette[0] is ignored; air is
+// transparent). vxl_init() sets all materials to white. the next
+// vxl_flush() repaints the pixels showing materials whose colour changed
+void vxl_set_palette(struct vxl* vxl, const u32* palette);
 
-	if (rotation != vxl->rotation) {
-		vxl->rotation = rotation;
-		vxl_set_full_update(vxl);
-	}
-}
+// rotates the view around the Z axis in 90° steps. without
+// VXL_CACHE_ROTATIONS this means re-rendering everything
+void vxl_set_rotation(struct vxl* vxl, int rotation);
 
 #define VXL_H
 #endif